@@ -0,0 +1,253 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Times parsing and digesting the EDID dumps named on the command line,
+ * such as /sys/class/drm/<connector>/edid of the monitors at hand. Built-in
+ * blobs check the fields first: a bare base block, one with a CTA-861
+ * extension carrying HDR metadata and one with a DisplayID 2.0 extension.
+ * Exits non-zero if a field comes out wrong.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "../edid.h"
+
+#define SECONDS 0.2 /* per dump and stage */
+#define BATCH   1000 /* calls per clock read, one call costs about as much as a read */
+#define NBLOBS  3
+#define MAXLEN  (256 * EDID_BLOCK) /* one base block and up to 255 extensions */
+
+static unsigned char blobs[NBLOBS][2 * EDID_BLOCK];
+static int lens[NBLOBS];
+static const char *names[NBLOBS] = { "base", "base+cta", "base+displayid" };
+
+static void
+checksum(unsigned char *block)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < EDID_BLOCK - 1; i++)
+		sum += block[i];
+	block[EDID_BLOCK - 1] = -sum;
+}
+
+/* 1920x1080 at 148.5 MHz, 2200x1125 total, 60 Hz, 527x296 mm */
+static void
+dtd_1080p(unsigned char *d)
+{
+	static const unsigned char dtd[18] = {
+		0x02, 0x3a, 0x80, 0x18, 0x71, 0x38, 0x2d, 0x40, 0x58, 0x2c,
+		0x45, 0x00, 0x0f, 0x28, 0x21, 0x00, 0x00, 0x1e
+	};
+
+	memcpy(d, dtd, sizeof(dtd));
+}
+
+static void
+text_descriptor(unsigned char *d, unsigned char tag, const char *text)
+{
+	size_t n = strlen(text);
+
+	memset(d, 0, 18);
+	d[3] = tag;
+	memset(d + 5, ' ', 13);
+	memcpy(d + 5, text, n);
+	if (n < 13)
+		d[5 + n] = '\n';
+}
+
+static void
+base_block(unsigned char *b, int nextensions, int continuous)
+{
+	static const unsigned char header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+	memset(b, 0, EDID_BLOCK);
+	memcpy(b, header, sizeof(header));
+	b[8] = 0x10; /* DEL */
+	b[9] = 0xac;
+	b[10] = 0x34;
+	b[11] = 0x12;
+	b[12] = 0x78;
+	b[13] = 0x56;
+	b[18] = 1;
+	b[19] = 4;
+	b[21] = 53;
+	b[22] = 30;
+	b[24] = continuous; /* the range limits only count with it */
+	dtd_1080p(b + 54);
+	text_descriptor(b + 72, 0xfc, "BENCH MON");
+	text_descriptor(b + 90, 0xff, "SN0001");
+	/* range limits 48-144 Hz */
+	memset(b + 108, 0, 18);
+	b[111] = 0xfd;
+	b[113] = 48;
+	b[114] = 144;
+	b[126] = nextensions;
+	checksum(b);
+}
+
+static void
+build_corpus(void)
+{
+	unsigned char *b;
+
+	base_block(blobs[0], 0, 1);
+	lens[0] = EDID_BLOCK;
+
+	base_block(blobs[1], 1, 1);
+	b = blobs[1] + EDID_BLOCK;
+	memset(b, 0, EDID_BLOCK);
+	b[0] = 0x02;
+	b[1] = 3;
+	b[2] = 4 + 7;
+	/* extended tag 6, HDR static metadata: SDR and PQ, 600 cd/m2 */
+	b[4] = 7 << 5 | 6;
+	b[5] = 0x06;
+	b[6] = 0x05;
+	b[7] = 0x01;
+	b[8] = 115;
+	b[9] = 0x60;
+	b[10] = 0x20;
+	dtd_1080p(b + 11);
+	checksum(b);
+	lens[1] = 2 * EDID_BLOCK;
+
+	base_block(blobs[2], 1, 0);
+	b = blobs[2] + EDID_BLOCK;
+	memset(b, 0, EDID_BLOCK);
+	b[0] = 0x70;
+	b[1] = 0x20;
+	b[2] = 9;
+	/* adaptive sync block, 40-165 Hz */
+	b[5] = 0x2b;
+	b[7] = 6;
+	b[10] = 40;
+	b[11] = 164;
+	checksum(b);
+	lens[2] = 2 * EDID_BLOCK;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+check(int i, const Edid *e)
+{
+	int ok;
+
+	ok = !strcmp(e->pnp, "DEL") && e->product == 0x1234 && !strcmp(e->name, "BENCH MON")
+	     && !strcmp(e->serialstr, "SN0001") && e->preferred.width == 1920
+	     && e->preferred.height == 1080 && e->preferred.refresh / 1000 == 60
+	     && e->width_mm == 527 && e->height_mm == 296;
+	switch (i) {
+	case 0:
+		ok = ok && e->vrr_min == 48 && e->vrr_max == 144 && !e->eotf;
+		break;
+	case 1:
+		ok = ok && e->eotf == 0x05 && e->max_luminance > 590 && e->max_luminance < 610;
+		break;
+	case 2:
+		ok = ok && e->nextensions == 1 && e->vrr_min == 40 && e->vrr_max == 165;
+		break;
+	}
+	if (!ok)
+		fprintf(stderr, "%s: parsed wrong\n", names[i]);
+	return ok;
+}
+
+/* Reads a dump into buf, returns its length or 0 if it is empty or unreadable */
+static int
+load(const char *path, unsigned char *buf)
+{
+	FILE *fp;
+	size_t n;
+
+	if (!(fp = fopen(path, "rb"))) {
+		perror(path);
+		return 0;
+	}
+	n = fread(buf, 1, MAXLEN, fp);
+	fclose(fp);
+	return (int)n;
+}
+
+/* Nanoseconds per edid_parse() and per edid_digest() of one dump */
+static void
+time_dump(const unsigned char *data, int len, double *tparse, double *tdigest)
+{
+	EdidDigest digest;
+	Edid edid;
+	double start;
+	long n;
+	int k;
+
+	start = now();
+	n = 0;
+	do {
+		for (k = 0; k < BATCH; k++)
+			edid_parse(data, len, &edid);
+		n += BATCH;
+	} while ((*tparse = now() - start) < SECONDS);
+	*tparse = *tparse / n * 1e9;
+
+	start = now();
+	n = 0;
+	do {
+		for (k = 0; k < BATCH; k++)
+			edid_digest(data, len, &digest);
+		n += BATCH;
+	} while ((*tdigest = now() - start) < SECONDS);
+	*tdigest = *tdigest / n * 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static unsigned char buf[MAXLEN];
+	Edid edid;
+	double tparse, tdigest, sparse = 0, sdigest = 0;
+	long bytes = 0;
+	int i, len, ndumps = 0, failed = 0;
+
+	build_corpus();
+	for (i = 0; i < NBLOBS; i++) {
+		if (!edid_parse(blobs[i], lens[i], &edid) || !check(i, &edid))
+			failed = 1;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "no EDID dumps given, only the fields were checked\n");
+		return failed;
+	}
+
+	printf("%-32s %6s %12s %12s\n", "dump", "bytes", "parse ns", "digest ns");
+	for (i = 1; i < argc; i++) {
+		/* connectors without a monitor have an empty edid file */
+		if (!(len = load(argv[i], buf)))
+			continue;
+		if (!edid_parse(buf, len, &edid)) {
+			fprintf(stderr, "%s: not an EDID\n", argv[i]);
+			continue;
+		}
+		time_dump(buf, len, &tparse, &tdigest);
+		printf("%-32s %6d %12.1f %12.1f\n", argv[i], len, tparse, tdigest);
+		sparse += tparse;
+		sdigest += tdigest;
+		bytes += len;
+		ndumps++;
+	}
+	if (ndumps)
+		printf("%d dumps, parse %.1f MB/s, digest %.1f MB/s\n", ndumps,
+		       bytes / sparse * 1e3, bytes / sdigest * 1e3);
+	return failed;
+}
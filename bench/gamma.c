@@ -0,0 +1,116 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Times gamma_ramp() against the pow() loop of xrandr it replaced and
+ * checks that no entry is more than 1 LSB away from it.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../gamma.h"
+
+#define SECONDS 0.2 /* per size and variant */
+
+typedef void (*RampFn)(unsigned short *, unsigned short *, unsigned short *, int,
+                       double, double, double, double);
+
+static const int sizes[] = { 256, 1024, 4096, 65536 };
+
+/* what xrandr did before gamma_ramp() */
+static void
+pow_ramp(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+         double gred, double ggreen, double gblue, double brightness)
+{
+	unsigned short *ramp[3];
+	double g[3], v;
+	int i, c;
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	g[0] = gred;
+	g[1] = ggreen;
+	g[2] = gblue;
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < size; i++) {
+			if (g[c] == 1.0 && brightness == 1.0)
+				v = (double)i / (size - 1);
+			else
+				v = fmin(pow((double)i / (size - 1), 1.0 / g[c]) * brightness, 1.0);
+			ramp[c][i] = v * 65535;
+		}
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nanoseconds per ramp of size entries, all three channels */
+static double
+time_ramp(RampFn f, unsigned short *r, int size)
+{
+	double start, elapsed;
+	long n = 0;
+
+	start = now();
+	do {
+		f(r, r + size, r + 2 * size, size, 2.2, 2.0, 1.8, 0.9);
+		n++;
+	} while ((elapsed = now() - start) < SECONDS);
+	return elapsed / n * 1e9;
+}
+
+/* Largest difference of any entry over a grid of gammas and brightnesses */
+static int
+max_error(unsigned short *a, unsigned short *b, int size)
+{
+	static const double gammas[] = { 0.1, 0.5, 1.0, 1.8, 2.2, 5.0, 10.0, 100.0, 1000.0 };
+	static const double brightnesses[] = { 0.0, 0.3, 1.0, 2.0 };
+	int i, j, k, d, worst = 0;
+
+	for (j = 0; j < (int)(sizeof(gammas) / sizeof(gammas[0])); j++) {
+		for (k = 0; k < (int)(sizeof(brightnesses) / sizeof(brightnesses[0])); k++) {
+			gamma_ramp(a, a + size, a + 2 * size, size, gammas[j], gammas[j], gammas[j], brightnesses[k]);
+			pow_ramp(b, b + size, b + 2 * size, size, gammas[j], gammas[j], gammas[j], brightnesses[k]);
+			for (i = 0; i < 3 * size; i++) {
+				d = abs(a[i] - b[i]);
+				if (d > worst)
+					worst = d;
+			}
+		}
+	}
+	return worst;
+}
+
+int
+main(void)
+{
+	unsigned short *a, *b;
+	double tfast, tpow;
+	int i, size, err, failed = 0;
+
+	printf("%8s %12s %12s %8s %6s\n", "size", "pow ns", "ramp ns", "speedup", "error");
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+		size = sizes[i];
+		if (!(a = malloc(3 * size * sizeof(unsigned short)))
+		    || !(b = malloc(3 * size * sizeof(unsigned short)))) {
+			fputs("out of memory\n", stderr);
+			return 1;
+		}
+		tpow = time_ramp(pow_ramp, b, size);
+		tfast = time_ramp(gamma_ramp, a, size);
+		err = max_error(a, b, size);
+		failed |= err > 1;
+		printf("%8d %12.0f %12.0f %7.1fx %6d\n", size, tpow, tfast, tpow / tfast, err);
+		free(a);
+		free(b);
+	}
+	return failed;
+}
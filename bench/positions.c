@@ -0,0 +1,142 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * Times set_positions() of xrandr.c on chains of --left-of outputs. Each
+ * output is listed before the one it is placed against, the order that
+ * costs one pass over all outputs per output in a fixed point search.
+ * Also checks the layout and that a loop is reported. No server needed.
+ */
+#define main xrandr_main
+#include "../xrandr.c"
+#undef main
+
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SECONDS 0.2 /* per chain length */
+
+static const int lengths[] = { 64, 1024, 16384 };
+static XRRModeInfo mode = { .width = 1920, .height = 1080 };
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Output i is left of output i + 1, the last one stays where it is. With
+ * loop set, the last one is left of the first instead. */
+static char **
+build_chain(int n, int loop)
+{
+	char **names;
+	output_t *output;
+	int i;
+
+	all_outputs = NULL;
+	all_outputs_tail = &all_outputs;
+	if (!(names = calloc(n, sizeof(char *))))
+		fatal("out of memory\n");
+	for (i = 0; i < n; i++) {
+		if (!(names[i] = malloc(24)))
+			fatal("out of memory\n");
+		snprintf(names[i], 24, "VIRTUAL%d", i);
+	}
+	for (i = 0; i < n; i++) {
+		output = add_output();
+		set_name_string(&output->output, names[i]);
+		output->mode_info = &mode;
+		output->rotation = RR_Rotate_0;
+		if (i < n - 1 || loop) {
+			output->changes |= changes_relation;
+			output->relation = relation_left_of;
+			output->relative_to = names[(i + 1) % n];
+		}
+	}
+	return names;
+}
+
+static void
+free_chain(char **names, int n)
+{
+	output_t *output, *next;
+	int i;
+
+	for (output = all_outputs; output; output = next) {
+		next = output->next;
+		free(output);
+	}
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+}
+
+static int
+check_layout(int n)
+{
+	output_t *output;
+	int i = 0;
+
+	for (output = all_outputs; output; output = output->next, i++)
+		if (output->x != i * (int)mode.width || output->y != 0)
+			return 0;
+	return 1;
+}
+
+/* set_positions() exits on a loop, so it runs in a child */
+static int
+loop_reported(int n)
+{
+	char **names;
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		names = build_chain(n, 1);
+		freopen("/dev/null", "w", stderr);
+		set_positions();
+		free_chain(names, n);
+		_exit(0);
+	}
+	return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+int
+main(int argc, char **argv)
+{
+	char **names;
+	double start, elapsed, t;
+	long runs;
+	int i, n, failed = 0;
+
+	program_name = argv[0];
+	printf("%8s %12s %12s\n", "outputs", "us", "ns/output");
+	for (i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+		n = lengths[i];
+		elapsed = 0;
+		runs = 0;
+		do {
+			names = build_chain(n, 0);
+			start = now();
+			set_positions();
+			elapsed += now() - start;
+			runs++;
+			if (runs == 1 && !check_layout(n)) {
+				fprintf(stderr, "%d outputs: wrong layout\n", n);
+				failed = 1;
+			}
+			free_chain(names, n);
+		} while (elapsed < SECONDS);
+		t = elapsed / runs;
+		printf("%8d %12.1f %12.1f\n", n, t * 1e6, t * 1e9 / n);
+	}
+	if (!loop_reported(64)) {
+		fprintf(stderr, "loop of 64 outputs not reported\n");
+		failed = 1;
+	}
+	return failed;
+}
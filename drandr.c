@@ -1,5 +1,6 @@
 /* See LICENSE file for copyright and license details. */
 #include <locale.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,7 @@
 #include <sys/wait.h>
 #include <sys/file.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -23,6 +25,9 @@
 
 
 #include "drw.h"
+#include "edid.h"
+#include "gamma.h"
+#include "profile.h"
 #include "util.h"
 
 #define INTERSECT(x, y, w, h, r)  (MAX(0, MIN((x)+(w),(r).x_org+(r).width)  - MAX((x),(r).x_org)) \
@@ -65,8 +70,6 @@ struct Button {
 };
 Button* hovered_button;
 
-#define EDID_SIZE 513
-
 enum {
     Top, Right, Bottom, Left
 };
@@ -74,7 +77,9 @@ enum {
 typedef struct OutputConnection OutputConnection;
 struct OutputConnection {
     RROutput output;
-    const char *edid;
+    Bool has_edid;
+    Edid monitor; // monitor.id tells outputs showing the same monitor apart
+    uint64_t profile_edid; // profile_edid_hash() of the EDID
     XRROutputInfo *info;
     XRRCrtcInfo *crtc_info;
 
@@ -86,7 +91,104 @@ struct OutputConnection {
     Bool disabled;
     RRMode mode;
 
+    // gamma panel, read from gamma_crtc when the output is first shown with a crtc
+    RRCrtc gamma_crtc;
+    XRRCrtcGamma *ramp; // buffer ramps are regenerated into
+    Bool gamma_failed; // gamma_crtc has no ramp, it is not asked again until the crtc changes
+    double brightness, gamma[3];
+};
+
+typedef struct CrtcOp CrtcOp;
+struct CrtcOp {
+    RRCrtc crtc;
+    int x, y;
+    RRMode mode; // None disables the crtc
+    Rotation rotation;
+    RROutput *outputs;
+    int noutput;
+    Status status;
+};
+
+typedef struct ApplyPlan ApplyPlan;
+struct ApplyPlan {
+    int width, height, width_mm, height_mm;
+    double dpi;
+    CrtcOp *ops;
+    int nops;
+    RROutput primary; // None leaves the primary output unchanged
+    int ndisable; // the first ndisable ops switch crtcs off before the screen is resized
+    CrtcOp check; // unchanged crtc sent ahead of the resize when nothing is disabled first
+};
+
+#define PLAN_CACHE_MAGIC "DRPLANC"
+#define PLAN_CACHE_VERSION 1
+#define PLAN_CACHE_ENTRIES 16
+#define PLAN_MAX_OPS 16
+#define PLAN_MAX_OUTPUTS 4
+
+/* Resolved apply plan of a profile, as stored in the plan cache file */
+typedef struct {
+    uint64_t crtc, mode;
+    int32_t x, y;
+    uint32_t rotation, noutput;
+    uint64_t outputs[PLAN_MAX_OUTPUTS];
+} CachedOp;
+
+typedef struct {
+    uint64_t set; // profile key of the monitor set
+    uint64_t key; // hash of the profile and of the server configuration the plan was resolved against
+    int32_t width, height, width_mm, height_mm;
+    double dpi;
+    uint64_t primary;
+    uint32_t nops, ndisable;
+    CachedOp ops[PLAN_MAX_OPS];
+} CachedPlan;
+
+/* Entries are only read back by builds with the same layout */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size; // sizeof(CachedPlan), changes with PLAN_MAX_*
+    uint32_t n;
+    uint32_t pad;
+} PlanCacheHeader;
+
+#define EDID_CACHE_MAGIC "DREDIDC"
+#define EDID_CACHE_ENTRIES 32
+
+/* Parsed EDID of an output, as stored in the EDID cache file */
+typedef struct {
+    char name[32]; // output name, outputs are looked up by name and XID
+    uint64_t output;
+    uint32_t has_edid;
+    uint32_t pad;
+    uint64_t profile_edid;
+    Edid monitor;
+} CachedEdid;
+
+/* Entries are only valid for the server configuration they were read in */
+typedef struct {
+    char magic[8];
+    uint64_t config; // config_stamp() of the screen resources
+    uint32_t entry_size; // sizeof(CachedEdid), tells builds apart
+    uint32_t n;
+} EdidCacheHeader;
+
+static CachedEdid edid_cache[EDID_CACHE_ENTRIES];
+static int n_edid_cache; // entries usable in place of the server, 0 once validated
+static Bool edids_unverified; // outputs were created from the cache
+
+#define GRAB_HIST_BUCKETS 12
+
+typedef struct ApplyStats ApplyStats;
+struct ApplyStats {
+    unsigned int napply;
+    unsigned int ngrab; // an apply retried after a conflict grabs twice
+    unsigned int nconflict; // applies rejected because another client changed the configuration
+    unsigned int grab_hist[GRAB_HIST_BUCKETS]; // bucket 0 counts grabs below 1 ms, bucket b those of [2^(b-1), 2^b) ms
+    int64_t grab_total_us, grab_max_us;
 };
+static ApplyStats apply_stats;
 
 typedef struct CrtcWindow CrtcWindow;
 struct CrtcWindow {
@@ -104,6 +206,14 @@ int grabbed_offset_x, grabbed_offset_y;
 
 static int selected_mode = 0, start_mode=0;
 
+enum { SliderBrightness, SliderRed, SliderGreen, SliderBlue, SliderLast };
+static const char *slider_names[] = {"Bright", "Red", "Green", "Blue"};
+static const double slider_min[] = {0.1, 0.3, 0.3, 0.3};
+static const double slider_max[] = {1.0, 3.0, 3.0, 3.0};
+static int grabbed_slider = -1;
+static OutputConnection *gamma_dirty_ocon; // ramp changed since it was last sent
+static struct timespec gamma_sent;
+
 XRRScreenResources *sres;
 
 void remove_output_connection(OutputConnection *ocon);
@@ -114,11 +224,16 @@ static void recenter_canvas();
 static void update_canvas();
 static void apply();
 static void create_crtc_windows();
+static void validate_edid_cache();
+static double mode_refresh(const XRRModeInfo *mode_info);
 
 Button button_apply = {0, 0, 100, 12, "Apply", apply};
 Button* buttons[] = {&button_apply};
 
+static void print_apply_stats(void);
+
 static void cleanup(void) {
+    print_apply_stats();
     while (head) {
         remove_output_connection(head);
     }
@@ -132,16 +247,17 @@ static void cleanup(void) {
 XRRModeInfo *get_mode_info(RRMode id) {
     int i;
     for (i = 0; i < sres->nmode && sres->modes[i].id != id; i++) {}
-    return &sres->modes[i];
+    return i < sres->nmode ? &sres->modes[i] : NULL;
 }
 
 void free_output_connection(OutputConnection *ocon) {
     if (ocon) {
         if (ocon == grabbed_ocon) grabbed_ocon = NULL;
         if (ocon == selected_ocon) selected_ocon = NULL;
+        if (ocon == gamma_dirty_ocon) gamma_dirty_ocon = NULL;
         XRRFreeOutputInfo(ocon->info);
         XRRFreeCrtcInfo(ocon->crtc_info);
-        free((char*) ocon->edid);
+        if (ocon->ramp) XRRFreeGamma(ocon->ramp);
         free(ocon);
     }
 }
@@ -158,6 +274,9 @@ void remove_output_connection(OutputConnection *ocon) {
     } else {
         ocon->prev->next = ocon->next;
     }
+    if (ocon->next) {
+        ocon->next->prev = ocon->prev;
+    }
 
     free_output_connection(ocon);
 }
@@ -174,72 +293,134 @@ void append_output_connection(OutputConnection *ocon) {
 }
 
 
-const char *get_edid(RROutput out) {
-    int props = 0;
-    Atom *properties;
-    Atom atom_edid, real;
-    int i, format;
-    char *edid = NULL;
+/* Parses the output's EDID into ocon, the blob itself is not kept */
+static void get_edid(RROutput out, OutputConnection *ocon) {
     unsigned char *p;
-    char *ep;
-    unsigned long n, extra;
-    Bool has_edid_prop = False;
+    int n;
 
+    if ((p = edid_get(dpy, out, &n))) {
+        ocon->has_edid = edid_parse(p, n, &ocon->monitor);
+        ocon->profile_edid = profile_edid_hash(p, n);
+        XFree(p);
+    }
+}
 
-    properties = XRRListOutputProperties(dpy, out, &props);
-    atom_edid = XInternAtom(dpy, RR_PROPERTY_RANDR_EDID, False);
-    for (i = 0; i < props; i++) {
-        if (properties[i] == atom_edid) {
-            has_edid_prop = True;
-            break;
-        }
+static const char *cache_path(char *path, size_t size, const char *name) {
+    const char *base;
+
+    if (path[0]) return path;
+    if ((base = getenv("XDG_CACHE_HOME")) && base[0]) {
+        snprintf(path, size, "%s/drandr/%s", base, name);
+    } else if ((base = getenv("HOME"))) {
+        snprintf(path, size, "%s/.cache/drandr/%s", base, name);
+    } else {
+        return NULL;
     }
-    XFree(properties);
-
-    if (has_edid_prop) {
-        if (XRRGetOutputProperty(dpy, out, atom_edid, 0L, 128L, False, False,
-                                 AnyPropertyType, &real, &format, &n, &extra, &p) == Success) {
-            if (n >= 127) {
-                edid = ecalloc(2*n+1, sizeof(char));
-                ep = edid;
-                for (i = 0; i < n; i++) {
-                    snprintf(ep, EDID_SIZE-(ep-edid),"%02x", p[i]);
-                    ep += 2;
-                }
-                *ep = 0;
-            }
-            free(p);
-        }
+    return path;
+}
+
+static const char *edid_cache_path() {
+    static char path[4096];
+    return cache_path(path, sizeof(path), "edids");
+}
+
+/* Changes whenever the server's output configuration changes */
+static uint64_t config_stamp(XRRScreenResources *res) {
+    return (uint64_t) res->configTimestamp << 32 | (uint32_t) res->timestamp;
+}
+
+/* Reads the entries of the EDID cache, they only count if the cache was
+ * written in the configuration of res */
+static int load_edid_cache(XRRScreenResources *res) {
+    EdidCacheHeader hdr;
+    FILE *fp;
+    size_t n = 0;
+
+    n_edid_cache = 0;
+    if (!edid_cache_path() || !(fp = fopen(edid_cache_path(), "r"))) return 0;
+    if (fread(&hdr, sizeof(hdr), 1, fp) == 1 && !memcmp(hdr.magic, EDID_CACHE_MAGIC, sizeof(hdr.magic))
+            && hdr.entry_size == sizeof(CachedEdid) && hdr.config == config_stamp(res)) {
+        n = fread(edid_cache, sizeof(CachedEdid), MIN(hdr.n, EDID_CACHE_ENTRIES), fp);
     }
-    return edid;
+    fclose(fp);
+    n_edid_cache = (int) n;
+    return n_edid_cache;
 }
 
-OutputConnection *create_output_connection(RROutput output, XRROutputInfo *info) {
-    XRRModeInfo *mode_info;
+static void store_edid_cache() {
+    EdidCacheHeader hdr;
+    CachedEdid entries[EDID_CACHE_ENTRIES], *c;
     OutputConnection *ocon;
-    const char* edid;
+    char tmp[4096 + 8];
+    FILE *fp;
+    int ok;
+
+    if (!edid_cache_path()) return;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, EDID_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.config = config_stamp(sres);
+    hdr.entry_size = sizeof(CachedEdid);
+    memset(entries, 0, sizeof(entries));
+    for (ocon = head; ocon && hdr.n < EDID_CACHE_ENTRIES; ocon = ocon->next) {
+        c = &entries[hdr.n++];
+        snprintf(c->name, sizeof(c->name), "%s", ocon->info->name);
+        c->output = ocon->output;
+        c->has_edid = ocon->has_edid;
+        c->profile_edid = ocon->profile_edid;
+        c->monitor = ocon->monitor;
+    }
 
-    if (!info) {
-        info = XRRGetOutputInfo(dpy, sres, output);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", edid_cache_path());
+    if (mkdirs(tmp) < 0 || !(fp = fopen(tmp, "w"))) return;
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(entries, sizeof(CachedEdid), hdr.n, fp) == hdr.n;
+    if (fclose(fp) == EOF || !ok || rename(tmp, edid_cache_path()) < 0) {
+        unlink(tmp);
     }
+}
 
-    edid = get_edid(output);
+/* Takes the EDID of the output from the cache, which spares the property round trips */
+static Bool cached_edid(RROutput out, XRROutputInfo *info, OutputConnection *ocon) {
+    int i;
 
-    for (ocon = head; ocon;) {
-        if (edid && ocon->edid && strcmp(edid, ocon->edid) == 0) {
-            remove_output_connection(ocon);
-            ocon = head; //TODO: this is a bad loop
-        } else {
-            ocon = ocon->next;
+    for (i = 0; i < n_edid_cache; i++) {
+        if (edid_cache[i].output == out && !strncmp(edid_cache[i].name, info->name, sizeof(edid_cache[i].name))) {
+            ocon->has_edid = edid_cache[i].has_edid;
+            ocon->profile_edid = edid_cache[i].profile_edid;
+            ocon->monitor = edid_cache[i].monitor;
+            edids_unverified = True;
+            return True;
         }
     }
+    return False;
+}
+
+/* Hex digest of the EDID for messages, label holds 33 chars */
+static const char *edid_label(OutputConnection *ocon, char *label) {
+    return ocon->has_edid ? edid_digest_hex(&ocon->monitor.id, label) : "unknown";
+}
+
+OutputConnection *create_output_connection(RROutput output, XRROutputInfo *info) {
+    XRRModeInfo *mode_info;
+    OutputConnection *ocon, *next;
+
+    if (!info) {
+        info = XRRGetOutputInfo(dpy, sres, output);
+    }
 
     ocon = ecalloc(1, sizeof(OutputConnection));
-    memset(ocon, 0, sizeof(OutputConnection));
     ocon->output = output;
     ocon->mode = 0;
+    if (!cached_edid(output, info, ocon)) {
+        get_edid(output, ocon);
+    }
 
-    ocon->edid = edid;
+    // the monitor moved to this output
+    for (OutputConnection *old = head; ocon->has_edid && old; old = next) {
+        next = old->next;
+        if (old->has_edid && EDID_SAME(old->monitor.id, ocon->monitor.id)) {
+            remove_output_connection(old);
+        }
+    }
 
     ocon->info = info;
 
@@ -282,13 +463,14 @@ void get_outputs() {
             XRRFreeOutputInfo(info);
         }
     }
-    create_crtc_windows(sres);
 }
 
 static void handle_output_change_event(XRROutputChangeNotifyEvent *ev) {
+    char label[33];
     XRROutputInfo *info;
     OutputConnection *ocon;
 
+    n_edid_cache = 0;
     if (sres) XRRFreeScreenResources(sres);
     sres = XRRGetScreenResourcesCurrent(ev->display, ev->window);
     if (!sres) {
@@ -304,12 +486,13 @@ static void handle_output_change_event(XRROutputChangeNotifyEvent *ev) {
     switch (info->connection) {
         case RR_Connected:
             ocon = create_output_connection(ev->output, NULL);
-            printf("connected %s (EDID: %s)\n", ocon->info->name, ocon->edid);
+            printf("connected %s (%s%sEDID: %s)\n", ocon->info->name, ocon->monitor.name,
+                   ocon->monitor.name[0] ? ", " : "", edid_label(ocon, label));
             break;
         case RR_Disconnected:
             ocon = get_output_connection(ev->output);
             if (ocon) {
-                printf("disconnected %s (EDID: %s)\n", ocon->info->name, ocon->edid);
+                printf("disconnected %s (EDID: %s)\n", ocon->info->name, edid_label(ocon, label));
                 remove_output_connection(ocon);
             } else {
                 printf("disconnected %s (EDID: unknown)\n", info->name);
@@ -361,18 +544,22 @@ static OutputConnection *get_next_neighbor(OutputConnection *ocon, OutputConnect
     return NULL;
 }
 
-static void setup_new_coordinates(int *screen_width, int *screen_height, int *screen_width_mm, int *screen_height_mm,
-                                  double *dpi) {
-    OutputConnection *reference, *ocon, *neighbor;
-    int nst = INT_MAX, nsr = INT_MIN, nsb = INT_MIN, nsl = INT_MAX; // new screen top, right, bottom, left
-    int neighbordir;
+static OutputConnection *get_reference_output() {
+    OutputConnection *reference;
 
     for (reference = head; reference && !reference->crtc_info; reference = reference->next) {}
     if (!reference) {
         die("no output with ctrc found");
     }
+    return reference;
+}
 
-    *dpi = (25.4 * reference->crtc_info->height) / (double) reference->info->mm_height;
+/* Translates the canvas positions back into real coordinates. */
+static void setup_new_coordinates() {
+    OutputConnection *reference, *ocon, *neighbor;
+    int neighbordir;
+
+    reference = get_reference_output();
 
     for (ocon = head; ocon; ocon = ocon->next) {
         if (ocon->info->connection == RR_Disconnected || ocon->disabled) continue;
@@ -399,7 +586,21 @@ static void setup_new_coordinates(int *screen_width, int *screen_height, int *sc
                     break;
             }
         }
+    }
+}
+
+/* Moves the enabled outputs to the origin and sizes the screen around them. */
+static void setup_screen_size(int *screen_width, int *screen_height, int *screen_width_mm, int *screen_height_mm,
+                              double *dpi) {
+    OutputConnection *reference, *ocon;
+    int nst = INT_MAX, nsr = INT_MIN, nsb = INT_MIN, nsl = INT_MAX; // new screen top, right, bottom, left
+
+    reference = get_reference_output();
 
+    *dpi = (25.4 * reference->crtc_info->height) / (double) reference->info->mm_height;
+
+    for (ocon = head; ocon; ocon = ocon->next) {
+        if (ocon->info->connection == RR_Disconnected || ocon->disabled) continue;
 
         int ocun_right = (int) ocon->x + ocon->w;
         int ocun_bottom = (int) ocon->y + ocon->h;
@@ -425,134 +626,712 @@ static void setup_new_coordinates(int *screen_width, int *screen_height, int *sc
     *screen_height_mm = (int) ((25.4 * (double)(*screen_height)) / (*dpi));
 }
 
-static void disable_crtc(RRCrtc ctrc) {
-    XRRSetCrtcConfig (dpy, sres, ctrc, CurrentTime,
-                      0, 0, None, RR_Rotate_0, NULL, 0);
-    printf("disbaled crtc %ld\n", ctrc);
+static CrtcOp *plan_add_op(ApplyPlan *plan, RRCrtc crtc, RRMode mode, Rotation rotation) {
+    CrtcOp *op;
+
+    op = &plan->ops[plan->nops++];
+    memset(op, 0, sizeof(CrtcOp));
+    op->crtc = crtc;
+    op->mode = mode;
+    op->rotation = rotation;
+    op->status = RRSetConfigFailed;
+    return op;
 }
 
-static void disable_unused_crtcs(int screen_width, int screen_height) {
-    XRRCrtcInfo *crtc_info;
+static CrtcOp *plan_find_op(ApplyPlan *plan, RRCrtc crtc) {
+    int i;
+    for (i = 0; i < plan->nops && plan->ops[i].crtc != crtc; i++) {}
+    return i < plan->nops ? &plan->ops[i] : NULL;
+}
+
+static Bool crtc_has_connected_output(XRRCrtcInfo *crtc_info) {
     XRROutputInfo *output_info;
-    int i, o;
-    Bool output_connected;
+    Bool connected = False;
+    int o;
 
-    for (i = 0; i < sres->ncrtc; i++) {
-        crtc_info = XRRGetCrtcInfo(dpy, sres, sres->crtcs[i]);
+    for (o = 0; o < crtc_info->noutput && !connected; o++) {
+        output_info = XRRGetOutputInfo(dpy, sres, crtc_info->outputs[o]);
+        if (output_info) {
+            connected = output_info->connection != RR_Disconnected;
+            XRRFreeOutputInfo(output_info);
+        }
+    }
+    return connected;
+}
 
-        if (crtc_info->mode == None) {
-            XRRFreeCrtcInfo(crtc_info);
-            continue;
-        };
+static int find_unused_crtc(OutputConnection *ocon, XRRCrtcInfo **crtc_infos, Bool *crtc_used) {
+    int i, j;
 
-        // disabled if not in screen or no output assigned
-        if (crtc_info->x + crtc_info->width > screen_width
-                || crtc_info->y + crtc_info->height > screen_height
-                || crtc_info->noutput == 0) {
-            disable_crtc(sres->crtcs[i]);
-        } else if (crtc_info->noutput > 0) {
-            // disabled if no assigned output is connected
-            output_connected = False;
-            for (o = 0; o < crtc_info->noutput; o++) {
-                output_info = XRRGetOutputInfo(dpy, sres, crtc_info->outputs[o]);
-                if (output_info->connection != RR_Disconnected) {
-                    output_connected = True;
-                    XRRFreeOutputInfo(output_info);
-                    break;
+    for (j = 0; j < ocon->info->ncrtc; j++) {
+        for (i = 0; i < sres->ncrtc && sres->crtcs[i] != ocon->info->crtcs[j]; i++) {}
+        if (i < sres->ncrtc && crtc_infos[i] && !crtc_used[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Does every query and decision of an apply up front, so that the server grab only has to send requests. */
+static void build_apply_plan(ApplyPlan *plan) {
+    XRRCrtcInfo **crtc_infos, *crtc_info;
+    OutputConnection *ocon;
+    CrtcOp *op;
+    Bool *crtc_used;
+    int i;
+
+    memset(plan, 0, sizeof(ApplyPlan));
+    setup_screen_size(&plan->width, &plan->height, &plan->width_mm, &plan->height_mm, &plan->dpi);
+
+    plan->ops = ecalloc(sres->ncrtc + sres->noutput, sizeof(CrtcOp));
+    crtc_infos = ecalloc(sres->ncrtc, sizeof(XRRCrtcInfo *));
+    crtc_used = ecalloc(sres->ncrtc, sizeof(Bool));
+
+    for (i = 0; i < sres->ncrtc; i++) {
+        crtc_info = crtc_infos[i] = XRRGetCrtcInfo(dpy, sres, sres->crtcs[i]);
+        if (!crtc_info || crtc_info->mode == None) continue;
+        crtc_used[i] = crtc_info->noutput > 0;
+
+        // disabled if not in screen or no output assigned or no assigned output is connected
+        if (crtc_info->x + crtc_info->width > plan->width
+                || crtc_info->y + crtc_info->height > plan->height
+                || crtc_info->noutput == 0
+                || !crtc_has_connected_output(crtc_info)) {
+            plan_add_op(plan, sres->crtcs[i], None, RR_Rotate_0);
+        }
+    }
+    plan->ndisable = plan->nops;
+
+    for (ocon = head; ocon; ocon = ocon->next) {
+        if (ocon->crtc_info) {
+            if (ocon->disabled) {
+                if (!plan_find_op(plan, ocon->info->crtc)) {
+                    plan_add_op(plan, ocon->info->crtc, None, RR_Rotate_0);
                 }
-                XRRFreeOutputInfo(output_info);
+                continue;
             }
-            if (output_connected == False) {
-                disable_crtc(sres->crtcs[i]);
+            op = plan_add_op(plan, ocon->info->crtc, ocon->mode, ocon->crtc_info->rotation);
+            op->noutput = ocon->crtc_info->noutput;
+            op->outputs = ecalloc(op->noutput, sizeof(RROutput));
+            memcpy(op->outputs, ocon->crtc_info->outputs, op->noutput * sizeof(RROutput));
+        } else if (!ocon->disabled) {
+            if ((i = find_unused_crtc(ocon, crtc_infos, crtc_used)) < 0) {
+                fprintf(stderr, "Error: %lu %s: no unused crtc\n", ocon->output, ocon->info->name);
+                continue;
             }
+            crtc_used[i] = True;
+            op = plan_add_op(plan, sres->crtcs[i], ocon->mode, RR_Rotate_0);
+            op->noutput = 1;
+            op->outputs = ecalloc(1, sizeof(RROutput));
+            op->outputs[0] = ocon->output;
+        } else {
+            continue;
         }
-        XRRFreeCrtcInfo(crtc_info);
+        op->x = ocon->x;
+        op->y = ocon->y;
     }
+
+    for (i = 0; i < sres->ncrtc; i++) {
+        if (crtc_infos[i]) XRRFreeCrtcInfo(crtc_infos[i]);
+    }
+    free(crtc_infos);
+    free(crtc_used);
 }
 
-static Status add_output_to_unused_crtc(OutputConnection* ocon) {
-    Status s;
+static void free_apply_plan(ApplyPlan *plan) {
     int i;
+
+    for (i = 0; i < plan->nops; i++) {
+        free(plan->ops[i].outputs);
+    }
+    free(plan->ops);
+    free(plan->check.outputs);
+    memset(&plan->check, 0, sizeof(CrtcOp));
+    plan->ops = NULL;
+    plan->nops = plan->ndisable = 0;
+}
+
+/*
+ * Without a disable op the resize would go out before the first timestamp checked request.
+ * Setting a crtc to the state it was read in is a no-op for the server but checks the
+ * timestamps, and it is rejected if anything changed since, so it can not undo another client.
+ */
+static void prepare_timestamp_check(ApplyPlan *plan) {
     XRRCrtcInfo *crtc_info;
+    CrtcOp *check = &plan->check;
+
+    free(check->outputs);
+    memset(check, 0, sizeof(CrtcOp));
+    if (plan->ndisable || !plan->nops || !sres->ncrtc) return;
+    if (!(crtc_info = XRRGetCrtcInfo(dpy, sres, sres->crtcs[0]))) return;
+    check->crtc = sres->crtcs[0];
+    check->x = crtc_info->x;
+    check->y = crtc_info->y;
+    check->mode = crtc_info->mode;
+    check->rotation = crtc_info->rotation;
+    check->noutput = crtc_info->noutput;
+    if (check->noutput) {
+        check->outputs = ecalloc(check->noutput, sizeof(RROutput));
+        memcpy(check->outputs, crtc_info->outputs, check->noutput * sizeof(RROutput));
+    }
+    XRRFreeCrtcInfo(crtc_info);
+}
 
-    s = RRSetConfigFailed;
+static Bool conflict(Status status) {
+    return status == RRSetConfigInvalidTime || status == RRSetConfigInvalidConfigTime;
+}
 
-    for (i = 0; i < sres->ncrtc; i++) {
-        crtc_info = XRRGetCrtcInfo(dpy, sres, sres->crtcs[i]);
+/*
+ * Runs while the server is grabbed: no queries and no output, only the prepared requests.
+ * The first request carries the timestamps of sres, so the server rejects it if another
+ * client changed the configuration since sres was fetched. That is the first disable op,
+ * or the check of prepare_timestamp_check(), always ahead of the resize. Our own change
+ * moves the server's set time, so the remaining operations use CurrentTime. Returns False
+ * on such a conflict, before anything was changed.
+ */
+static Bool send_apply_plan(ApplyPlan *plan) {
+    CrtcOp *op;
+    Time time = sres->timestamp;
+    int i;
 
-        if (crtc_info->noutput > 0) {
-            XRRFreeCrtcInfo(crtc_info);
-            continue;
-        };
+    if (plan->check.crtc) {
+        op = &plan->check;
+        if (conflict(XRRSetCrtcConfig(dpy, sres, op->crtc, time, op->x, op->y, op->mode,
+                                      op->rotation, op->outputs, op->noutput))) {
+            return False;
+        }
+        time = CurrentTime;
+    }
+    for (i = 0; i < plan->nops; i++) {
+        if (i == plan->ndisable) {
+            XRRSetScreenSize(dpy, root, plan->width, plan->height, plan->width_mm, plan->height_mm);
+        }
+        op = &plan->ops[i];
+        op->status = XRRSetCrtcConfig(dpy, sres, op->crtc, time,
+                                      op->x, op->y, op->mode, op->rotation, op->outputs, op->noutput);
+        if (time != CurrentTime && conflict(op->status)) {
+            return False;
+        }
+        time = CurrentTime;
+    }
+    if (plan->nops == plan->ndisable) {
+        XRRSetScreenSize(dpy, root, plan->width, plan->height, plan->width_mm, plan->height_mm);
+    }
+    if (plan->primary) {
+        XRRSetOutputPrimary(dpy, root, plan->primary);
+    }
+    return True;
+}
 
-        RROutput *outputs = ecalloc(1, sizeof(RROutput));
-        outputs[0] = ocon->output;
+static int report_apply_plan(ApplyPlan *plan) {
+    OutputConnection *ocon;
+    CrtcOp *op;
+    const char *name;
+    int i, failed = 0;
 
-        printf("Setting: %lu %s: crtc: %lu mode: %lu\n", ocon->output, ocon->info->name, sres->crtcs[i], ocon->info->modes[0]);
+    printf("screen %d: %dx%d %dx%d mm %6.2fdpi\n", screen,
+           plan->width, plan->height, plan->width_mm, plan->height_mm, plan->dpi);
 
-        s = XRRSetCrtcConfig(dpy, sres, sres->crtcs[i], CurrentTime,
-                             ocon->x, ocon->y, ocon->mode, RR_Rotate_0,
-                             outputs, 1);
-        XRRFreeCrtcInfo(crtc_info);
-        break;
+    for (i = 0; i < plan->nops; i++) {
+        op = &plan->ops[i];
+        if (op->mode == None) {
+            if (op->status == RRSetConfigSuccess) {
+                printf("disabled crtc %lu\n", op->crtc);
+            } else {
+                fprintf(stderr, "Error: disabling crtc %lu\n", op->crtc);
+                failed++;
+            }
+            continue;
+        }
+        ocon = get_output_connection(op->outputs[0]);
+        name = ocon ? ocon->info->name : "?";
+        if (op->status == RRSetConfigSuccess) {
+            printf("Success: %lu %s: crtc: %lu mode: %lu\n", op->outputs[0], name, op->crtc, op->mode);
+        } else {
+            fprintf(stderr, "Error: %lu %s: crtc: %lu mode: %lu\n", op->outputs[0], name, op->crtc, op->mode);
+            failed++;
+        }
     }
-    return s;
+    return failed;
 }
 
-static void apply_output(OutputConnection* ocon) {
-    Status s;
+static void record_grab_time(int64_t us) {
+    int64_t ms;
+    int b;
 
-    s = RRSetConfigFailed;
+    for (b = 0, ms = us / 1000; ms > 0 && b < GRAB_HIST_BUCKETS - 1; ms >>= 1, b++) {}
+    apply_stats.grab_hist[b]++;
+    apply_stats.ngrab++;
+    apply_stats.grab_total_us += us;
+    apply_stats.grab_max_us = MAX(apply_stats.grab_max_us, us);
+}
+
+static void print_apply_stats(void) {
+    int b;
+
+    if (!apply_stats.napply) return;
 
-    if (ocon->crtc_info) {
-        if (ocon->disabled) {
-            disable_crtc(ocon->info->crtc);
+    printf("applies: %u, conflicts: %u, grab held avg %.3f ms, max %.3f ms\n", apply_stats.napply,
+           apply_stats.nconflict, apply_stats.grab_total_us / 1000.0 / apply_stats.ngrab,
+           apply_stats.grab_max_us / 1000.0);
+    for (b = 0; b < GRAB_HIST_BUCKETS; b++) {
+        if (!apply_stats.grab_hist[b]) continue;
+        if (b == GRAB_HIST_BUCKETS - 1) {
+            printf("  >= %4d ms: %u\n", 1 << (b - 1), apply_stats.grab_hist[b]);
         } else {
-            printf("Setting: %lu %s: crtc: %lu mode: %lu\n", ocon->output, ocon->info->name, ocon->info->crtc, ocon->crtc_info->mode);
+            printf("  %4d - %4d ms: %u\n", b ? 1 << (b - 1) : 0, 1 << b, apply_stats.grab_hist[b]);
+        }
+    }
+}
+
+static Bool grab_and_send(ApplyPlan *plan) {
+    struct timespec grab_start, grab_end, grab_time;
+    Bool sent;
+
+    prepare_timestamp_check(plan);
+    clock_gettime(CLOCK_MONOTONIC, &grab_start);
+    XGrabServer(dpy);
+    sent = send_apply_plan(plan);
+    XUngrabServer(dpy);
+    XFlush(dpy);
+    clock_gettime(CLOCK_MONOTONIC, &grab_end);
+
+    timespec_diff(&grab_time, &grab_end, &grab_start);
+    record_grab_time(timespec_to_us(&grab_time));
+    printf("grab held %.3f ms\n", timespec_to_us(&grab_time) / 1000.0);
+    return sent;
+}
+
+static Bool same_xids(const XID *a, int na, const XID *b, int nb) {
+    return na == nb && (!na || !memcmp(a, b, na * sizeof(XID)));
+}
 
-            s = XRRSetCrtcConfig(dpy, sres, ocon->info->crtc, CurrentTime,
-                                 ocon->x, ocon->y, ocon->mode, ocon->crtc_info->rotation,
-                                 ocon->crtc_info->outputs, ocon->crtc_info->noutput);
+static Bool plan_touches(ApplyPlan *plan, RRCrtc crtc, RROutput output) {
+    int i, j;
+
+    for (i = 0; i < plan->nops; i++) {
+        if (crtc && plan->ops[i].crtc == crtc) return True;
+        for (j = 0; output && j < plan->ops[i].noutput; j++) {
+            if (plan->ops[i].outputs[j] == output) return True;
         }
+    }
+    return False;
+}
 
-    } else {
-       s = add_output_to_unused_crtc(ocon);
+/*
+ * Fetches the current resources after a conflict. Fails if crtcs, outputs or modes
+ * were added or removed. Otherwise, if the configuration was set since sres, only the
+ * outputs the plan configures and the outputs on its crtcs are fetched again, and only
+ * infos whose timestamps moved are replaced, so the positions and modes chosen are kept.
+ */
+static Bool refresh_changed_resources(ApplyPlan *plan) {
+    XRRScreenResources *cur;
+    XRROutputInfo *info;
+    XRRCrtcInfo *crtc_info;
+    OutputConnection *ocon;
+    Bool changed;
+    int i;
+
+    if (!(cur = XRRGetScreenResourcesCurrent(dpy, root))) return False;
+    // crtcs, outputs and modes only come and go with the config timestamp
+    if (cur->configTimestamp != sres->configTimestamp) {
+        if (!same_xids(cur->crtcs, cur->ncrtc, sres->crtcs, sres->ncrtc)
+                || !same_xids(cur->outputs, cur->noutput, sres->outputs, sres->noutput)
+                || cur->nmode != sres->nmode) {
+            XRRFreeScreenResources(cur);
+            return False;
+        }
+        for (i = 0; i < cur->nmode && cur->modes[i].id == sres->modes[i].id; i++) {}
+        if (i < cur->nmode) {
+            XRRFreeScreenResources(cur);
+            return False;
+        }
     }
+    changed = cur->timestamp != sres->timestamp;
+    XRRFreeScreenResources(sres);
+    sres = cur;
+    if (!changed) return True;
 
-    if (s == RRSetConfigSuccess) {
-        printf("Success: %lu %s\n", ocon->output, ocon->info->name);
-    } else {
-        fprintf(stderr, "Error: %lu %s\n", ocon->output, ocon->info->name);
+    for (ocon = head; ocon; ocon = ocon->next) {
+        if (!plan_touches(plan, ocon->info->crtc, ocon->output)) continue;
+        if (!(info = XRRGetOutputInfo(dpy, sres, ocon->output))) continue;
+        if (info->timestamp == ocon->info->timestamp && info->crtc == ocon->info->crtc) {
+            XRRFreeOutputInfo(info);
+        } else {
+            XRRFreeOutputInfo(ocon->info);
+            ocon->info = info;
+        }
+
+        crtc_info = ocon->info->crtc ? XRRGetCrtcInfo(dpy, sres, ocon->info->crtc) : NULL;
+        if (crtc_info && ocon->crtc_info && crtc_info->timestamp == ocon->crtc_info->timestamp) {
+            XRRFreeCrtcInfo(crtc_info);
+        } else {
+            if (ocon->crtc_info) XRRFreeCrtcInfo(ocon->crtc_info);
+            ocon->crtc_info = crtc_info;
+        }
     }
+    return True;
 }
 
-static void apply() {
-    OutputConnection *ocon;
-    int screen_width, screen_height, screen_width_mm, screen_height_mm;
-    double dpi;
-    setup_new_coordinates(&screen_width, &screen_height, &screen_width_mm, &screen_height_mm, &dpi);
+/*
+ * Sends a plan under a server grab and reports the outcome, returns the number of failed operations.
+ * If another client changed the configuration in the meantime, the changed resources are refreshed
+ * and the plan is sent once more, rebuilt from the outputs if rebuild is set.
+ */
+static int run_apply_plan(ApplyPlan *plan, Bool rebuild) {
+    RROutput primary;
+    int failed;
 
+    apply_stats.napply++;
     printf("Apply\n");
+    if (!grab_and_send(plan)) {
+        apply_stats.nconflict++;
+        printf("configuration was changed by another client, retrying\n");
+        if (!refresh_changed_resources(plan)) {
+            fprintf(stderr, "Error: screen resources changed, not retrying\n");
+            fflush(stdout);
+            return plan->nops ? plan->nops : 1;
+        }
+        if (rebuild) {
+            primary = plan->primary;
+            free_apply_plan(plan);
+            build_apply_plan(plan);
+            plan->primary = primary;
+        }
+        if (!grab_and_send(plan)) {
+            fprintf(stderr, "Error: configuration changed again\n");
+        }
+    }
 
-    XGrabServer(dpy);
+    failed = report_apply_plan(plan);
+    fflush(stdout);
+    return failed;
+}
 
-    disable_unused_crtcs(screen_width, screen_height);
+/*
+ * Slot of the profile for a monitor. Beyond PROFILE_MAX_OUTPUTS monitors the ones with the
+ * smallest EDID hashes are kept, so the key does not depend on the order of the outputs.
+ * Returns NULL if the monitor is left out, dropped counts the monitors left out.
+ */
+static ProfileOutput *profile_slot(Profile *profile, uint64_t edid, int *dropped) {
+    ProfileOutput *po;
+    int i, largest = 0;
+
+    if (profile->noutput < PROFILE_MAX_OUTPUTS) {
+        return &profile->outputs[profile->noutput++];
+    }
+    (*dropped)++;
+    for (i = 1; i < PROFILE_MAX_OUTPUTS; i++) {
+        if (profile->outputs[i].edid > profile->outputs[largest].edid) largest = i;
+    }
+    po = &profile->outputs[largest];
+    if (edid >= po->edid) return NULL;
+    memset(po, 0, sizeof(ProfileOutput));
+    return po;
+}
 
-    printf("screen %d: %dx%d %dx%d mm %6.2fdpi\n", screen,
-           screen_width, screen_height, screen_width_mm, screen_height_mm, dpi);
-    fflush(stdout);
-    XRRSetScreenSize(dpy, root, screen_width, screen_height,
-                      screen_width_mm, screen_height_mm);
+static void warn_dropped(int dropped) {
+    if (dropped) {
+        fprintf(stderr, "%d monitors beyond %d are not part of the profile\n", dropped, PROFILE_MAX_OUTPUTS);
+    }
+}
 
+/* Remembers the current layout as the profile of the connected monitor set. */
+static void save_profile() {
+    Profile profile;
+    ProfileOutput *po;
+    OutputConnection *ocon;
+    XRRModeInfo *mode_info;
+    RROutput primary;
+    int dropped = 0;
+
+    memset(&profile, 0, sizeof(Profile));
+    primary = XRRGetOutputPrimary(dpy, root);
 
     for (ocon = head; ocon; ocon = ocon->next) {
-        apply_output(ocon);
+        if (!ocon->has_edid || !(po = profile_slot(&profile, ocon->profile_edid, &dropped))) continue;
+        po->edid = ocon->profile_edid;
+        po->x = ocon->x;
+        po->y = ocon->y;
+        po->w = (uint16_t) ocon->w;
+        po->h = (uint16_t) ocon->h;
+        if (ocon->mode && (mode_info = get_mode_info(ocon->mode))) {
+            po->refresh = (uint32_t) (mode_refresh(mode_info) * 1000);
+        }
+        po->disabled = ocon->disabled;
+        po->primary = ocon->output == primary;
     }
+    if (!profile.noutput) return;
+    warn_dropped(dropped);
+    profile_finish(&profile);
+
+    if (profiledb_store(profiledb_path(), &profile) < 0) {
+        fprintf(stderr, "could not save profile to %s\n", profiledb_path() ? profiledb_path() : "(no path)");
+    }
+}
+
+static void apply() {
+    ApplyPlan plan;
+
+    setup_new_coordinates();
+    build_apply_plan(&plan);
+    if (run_apply_plan(&plan, True) == 0) {
+        save_profile();
+    }
+    free_apply_plan(&plan);
 
-    XUngrabServer(dpy);
     XSync(dpy, False);
+    XRRFreeScreenResources(sres);
+    if (!(sres = XRRGetScreenResourcesCurrent(dpy, root))) {
+        die("could not get screen resources");
+    }
     get_outputs();
+    create_crtc_windows();
     update_canvas();
+    store_edid_cache();
+}
+
+/* Probes the outputs and checks the EDIDs the first frame was drawn with,
+ * the outputs are built again if anything changed */
+static void validate_edid_cache() {
+    XRRScreenResources *probed;
+    OutputConnection *ocon, check;
+    Bool stale;
+
+    edids_unverified = False;
+    n_edid_cache = 0;
+    if (!(probed = XRRGetScreenResources(dpy, root))) return;
+    stale = config_stamp(probed) != config_stamp(sres);
+    for (ocon = head; ocon && !stale; ocon = ocon->next) {
+        memset(&check, 0, sizeof(check));
+        get_edid(ocon->output, &check);
+        stale = check.has_edid != ocon->has_edid
+                || (check.has_edid && !EDID_SAME(check.monitor.id, ocon->monitor.id));
+    }
+    XRRFreeScreenResources(sres);
+    sres = probed;
+    if (stale) {
+        while (head) {
+            remove_output_connection(head);
+        }
+        get_outputs();
+        create_crtc_windows();
+        update_canvas();
+    }
+    store_edid_cache();
+}
+
+static RRMode find_output_mode(OutputConnection *ocon, unsigned int w, unsigned int h, unsigned int refresh) {
+    XRRModeInfo *mode_info;
+    RRMode mode = None;
+    long diff, best_diff = 0;
+    int i;
+
+    for (i = 0; i < ocon->info->nmode; i++) {
+        mode_info = get_mode_info(ocon->info->modes[i]);
+        if (!mode_info || mode_info->width != w || mode_info->height != h) continue;
+        diff = labs((long) (mode_refresh(mode_info) * 1000) - (long) refresh);
+        if (mode == None || diff < best_diff) {
+            mode = mode_info->id;
+            best_diff = diff;
+        }
+    }
+    return mode;
+}
+
+static const char *plan_cache_path() {
+    static char path[4096];
+    return cache_path(path, sizeof(path), "plans");
+}
+
+/* A cached plan is only valid for the same profile on the same crtcs, outputs and modes. */
+static uint64_t plan_cache_key(const Profile *profile) {
+    uint64_t h;
+    int i;
+
+    h = fnv1a(FNV_OFFSET, profile, sizeof(Profile));
+    h = fnv1a(h, &sres->configTimestamp, sizeof(sres->configTimestamp));
+    h = fnv1a(h, sres->crtcs, sres->ncrtc * sizeof(RRCrtc));
+    h = fnv1a(h, sres->outputs, sres->noutput * sizeof(RROutput));
+    for (i = 0; i < sres->nmode; i++) {
+        h = fnv1a(h, &sres->modes[i].id, sizeof(RRMode));
+    }
+    return h;
+}
+
+static int load_plan_cache(CachedPlan *entries) {
+    PlanCacheHeader hdr;
+    FILE *fp;
+    size_t n = 0;
+
+    if (!plan_cache_path() || !(fp = fopen(plan_cache_path(), "r"))) return 0;
+    if (fread(&hdr, sizeof(hdr), 1, fp) == 1 && !memcmp(hdr.magic, PLAN_CACHE_MAGIC, sizeof(hdr.magic))
+            && hdr.version == PLAN_CACHE_VERSION && hdr.entry_size == sizeof(CachedPlan)) {
+        n = fread(entries, sizeof(CachedPlan), MIN(hdr.n, PLAN_CACHE_ENTRIES), fp);
+    }
+    fclose(fp);
+    return (int) n;
+}
+
+/* Looks up the plan of a monitor set, drops it from the cache when the server configuration changed. */
+static Bool find_cached_plan(uint64_t set, uint64_t key, ApplyPlan *plan) {
+    CachedPlan entries[PLAN_CACHE_ENTRIES], *c;
+    CrtcOp *op;
+    int i, n;
+
+    n = load_plan_cache(entries);
+    for (i = 0; i < n && entries[i].set != set; i++) {}
+    if (i == n) return False;
+    c = &entries[i];
+    if (c->key != key || c->nops > PLAN_MAX_OPS || c->ndisable > c->nops) return False;
+
+    memset(plan, 0, sizeof(ApplyPlan));
+    plan->width = c->width;
+    plan->height = c->height;
+    plan->width_mm = c->width_mm;
+    plan->height_mm = c->height_mm;
+    plan->dpi = c->dpi;
+    plan->primary = c->primary;
+    plan->ndisable = (int) c->ndisable;
+    plan->ops = ecalloc(c->nops ? c->nops : 1, sizeof(CrtcOp));
+    for (i = 0; i < (int) c->nops; i++) {
+        op = plan_add_op(plan, c->ops[i].crtc, c->ops[i].mode, (Rotation) c->ops[i].rotation);
+        op->x = c->ops[i].x;
+        op->y = c->ops[i].y;
+        op->noutput = (int) MIN(c->ops[i].noutput, PLAN_MAX_OUTPUTS);
+        if (op->noutput) {
+            op->outputs = ecalloc(op->noutput, sizeof(RROutput));
+            for (n = 0; n < op->noutput; n++) {
+                op->outputs[n] = c->ops[i].outputs[n];
+            }
+        }
+    }
+    return True;
+}
+
+/* Puts the plan first in the cache, replacing an older plan of the same monitor set. */
+static void store_cached_plan(uint64_t set, uint64_t key, ApplyPlan *plan) {
+    PlanCacheHeader hdr;
+    CachedPlan entries[PLAN_CACHE_ENTRIES + 1], *c;
+    char tmp[4096 + 8];
+    FILE *fp;
+    int i, j, n;
+
+    if (plan->nops > PLAN_MAX_OPS || !plan_cache_path()) return;
+
+    n = load_plan_cache(entries + 1);
+    for (i = 1; i <= n && entries[i].set != set; i++) {}
+    if (i <= n) {
+        memmove(&entries[i], &entries[i + 1], (n - i) * sizeof(CachedPlan));
+        n--;
+    }
+    n = MIN(n + 1, PLAN_CACHE_ENTRIES);
+
+    c = &entries[0];
+    memset(c, 0, sizeof(CachedPlan));
+    c->set = set;
+    c->key = key;
+    c->width = plan->width;
+    c->height = plan->height;
+    c->width_mm = plan->width_mm;
+    c->height_mm = plan->height_mm;
+    c->dpi = plan->dpi;
+    c->primary = plan->primary;
+    c->nops = (uint32_t) plan->nops;
+    c->ndisable = (uint32_t) plan->ndisable;
+    for (i = 0; i < plan->nops; i++) {
+        if (plan->ops[i].noutput > PLAN_MAX_OUTPUTS) return;
+        c->ops[i].crtc = plan->ops[i].crtc;
+        c->ops[i].mode = plan->ops[i].mode;
+        c->ops[i].x = plan->ops[i].x;
+        c->ops[i].y = plan->ops[i].y;
+        c->ops[i].rotation = plan->ops[i].rotation;
+        c->ops[i].noutput = (uint32_t) plan->ops[i].noutput;
+        for (j = 0; j < plan->ops[i].noutput; j++) {
+            c->ops[i].outputs[j] = plan->ops[i].outputs[j];
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PLAN_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = PLAN_CACHE_VERSION;
+    hdr.entry_size = sizeof(CachedPlan);
+    hdr.n = (uint32_t) n;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", plan_cache_path());
+    if (mkdirs(tmp) < 0 || !(fp = fopen(tmp, "w"))) return;
+    i = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(entries, sizeof(CachedPlan), n, fp) == (size_t) n;
+    if (fclose(fp) == EOF || !i || rename(tmp, plan_cache_path()) < 0) {
+        unlink(tmp);
+    }
+}
+
+/* Applies the stored profile of the connected monitor set without any gui, returns the exit status. */
+static int apply_profile() {
+    ProfileDB db;
+    Profile key;
+    const Profile *profile;
+    const ProfileOutput *po;
+    OutputConnection *ocon;
+    ApplyPlan plan;
+    RRMode mode;
+    RROutput primary = None;
+    ProfileOutput *slot;
+    uint64_t set, cache_key;
+    int failed, dropped = 0;
+
+    memset(&key, 0, sizeof(Profile));
+    for (ocon = head; ocon; ocon = ocon->next) {
+        if (ocon->has_edid && (slot = profile_slot(&key, ocon->profile_edid, &dropped))) {
+            slot->edid = ocon->profile_edid;
+        }
+    }
+    warn_dropped(dropped);
+    profile_finish(&key);
+
+    profiledb_open(&db, profiledb_path());
+    if (!key.noutput || !(profile = profiledb_find(&db, &key))) {
+        fprintf(stderr, "no profile for the connected monitors\n");
+        profiledb_close(&db);
+        return 1;
+    }
+
+    set = profile->key;
+    cache_key = plan_cache_key(profile);
+    if (find_cached_plan(set, cache_key, &plan)) {
+        profiledb_close(&db);
+        failed = run_apply_plan(&plan, False);
+        free_apply_plan(&plan);
+        return failed ? 1 : 0;
+    }
+
+    for (ocon = head; ocon; ocon = ocon->next) {
+        if (!ocon->has_edid || !(po = profile_output(profile, ocon->profile_edid))) continue;
+        ocon->disabled = po->disabled;
+        if (po->disabled) continue;
+        if (!(mode = find_output_mode(ocon, po->w, po->h, po->refresh))) {
+            fprintf(stderr, "%s: no %ux%u mode, leaving it disabled\n", ocon->info->name, po->w, po->h);
+            ocon->disabled = True;
+            continue;
+        }
+        ocon->mode = mode;
+        ocon->x = po->x;
+        ocon->y = po->y;
+        ocon->w = (int) po->w;
+        ocon->h = (int) po->h;
+        if (po->primary) {
+            primary = ocon->output;
+        }
+    }
+    profiledb_close(&db);
+
+    build_apply_plan(&plan);
+    plan.primary = primary;
+    failed = run_apply_plan(&plan, True);
+    if (!failed) {
+        store_cached_plan(set, cache_key, &plan);
+    }
+    free_apply_plan(&plan);
+    return failed ? 1 : 0;
 }
 
 /* v refresh frequency in Hz */
@@ -786,6 +1565,9 @@ static void draw_output(OutputConnection *ocon) {
 
     y += bh;
     drw_rect(drw, ocon->cx+1+bw, y, ocon->cw-2-2*bw, ocon->ch-1-1*bw - (y - ocon->cy), 1, 1);
+    if (ocon->monitor.name[0] && ocon->ch-1-bw - (y - ocon->cy) >= bh) {
+        drw_text(drw, ocon->cx+1+bw, y, ocon->cw-2-2*bw, bh, lrpad/2, ocon->monitor.name, 0);
+    }
     if (bw > 0) {
         drw_setscheme(drw, is_selected ? scheme[SchemeSel] : scheme[SchemeMon]);
         drw_rect(drw, ocon->cx+1, ocon->cy+1+bh, bw, ocon->ch-1-bh-1*bw, 1, 1);
@@ -796,8 +1578,124 @@ static int get_modes_start_y() {
     return (int)(2.5*bh);
 }
 
+static int get_gamma_start_y() {
+    return button_apply.y - (SliderLast + 1) * bh;
+}
+
 static int get_modes_per_page() {
-    return (mh-2*bh-get_modes_start_y())/bh;
+    return (get_gamma_start_y() - bh/2 - get_modes_start_y())/bh;
+}
+
+static double *slider_value(OutputConnection *ocon, int slider) {
+    return slider == SliderBrightness ? &ocon->brightness : &ocon->gamma[slider - SliderRed];
+}
+
+static void get_slider_bar(int *x, int *w) {
+    int label_w = TEXTW("Bright ");
+    *x = cw + label_w;
+    *w = side_area - label_w - TEXTW("0.00") - lrpad/2;
+}
+
+/* Reads the current ramp of the output's crtc and fits brightness and gamma to it,
+ * returns False without crtc or if the crtc has no gamma */
+static Bool read_gamma(OutputConnection *ocon) {
+    double exponent[3];
+    int i;
+
+    if (!ocon->info->crtc) {
+        return False;
+    }
+    if (ocon->gamma_crtc == ocon->info->crtc && (ocon->ramp || ocon->gamma_failed)) {
+        return ocon->ramp != NULL;
+    }
+    if (ocon->ramp) {
+        XRRFreeGamma(ocon->ramp);
+    }
+    ocon->gamma_crtc = ocon->info->crtc;
+    if (!XRRGetCrtcGammaSize(dpy, ocon->gamma_crtc) || !(ocon->ramp = XRRGetCrtcGamma(dpy, ocon->gamma_crtc))) {
+        ocon->ramp = NULL;
+        ocon->gamma_failed = True;
+        return False;
+    }
+    ocon->gamma_failed = False;
+    gamma_fit(ocon->ramp->red, ocon->ramp->green, ocon->ramp->blue, ocon->ramp->size, exponent, &ocon->brightness);
+    for (i = 0; i < 3; i++) {
+        ocon->gamma[i] = exponent[i] > 0 ? 1 / exponent[i] : 1;
+    }
+    return True;
+}
+
+static void set_slider(int x) {
+    int bar_x, bar_w;
+    double f;
+
+    get_slider_bar(&bar_x, &bar_w);
+    f = (double) (x - bar_x) / bar_w;
+    f = MAX(0.0, MIN(1.0, f));
+    *slider_value(selected_ocon, grabbed_slider) = slider_min[grabbed_slider]
+            + f * (slider_max[grabbed_slider] - slider_min[grabbed_slider]);
+    gamma_dirty_ocon = selected_ocon;
+}
+
+/*
+ * Regenerates and sends the ramp of the output being adjusted, at most once per frame of that output,
+ * so dragging a slider costs one XRRSetCrtcGamma per frame however many motion events arrive.
+ */
+static void send_gamma() {
+    OutputConnection *ocon = gamma_dirty_ocon;
+    XRRModeInfo *mode_info;
+    struct timespec now, diff;
+    int64_t frame_us = (int64_t) interval * 1000;
+
+    if (!ocon || !ocon->ramp) {
+        return;
+    }
+    if (ocon->crtc_info && (mode_info = get_mode_info(ocon->crtc_info->mode)) && mode_refresh(mode_info) > 0) {
+        frame_us = (int64_t) (1000000 / mode_refresh(mode_info));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timespec_diff(&diff, &now, &gamma_sent);
+    if (timespec_to_us(&diff) < frame_us) {
+        return;
+    }
+
+    gamma_ramp(ocon->ramp->red, ocon->ramp->green, ocon->ramp->blue, ocon->ramp->size,
+               ocon->gamma[0], ocon->gamma[1], ocon->gamma[2], ocon->brightness);
+    XRRSetCrtcGamma(dpy, ocon->gamma_crtc, ocon->ramp);
+    XFlush(dpy);
+    gamma_sent = now;
+    gamma_dirty_ocon = NULL;
+}
+
+static void draw_gamma() {
+    int i, y, bar_x, bar_w, fill;
+    double v;
+
+    y = get_gamma_start_y();
+    drw_setscheme(drw, scheme[SchemeNorm]);
+    drw_text(drw, cw, y, side_area, bh, lrpad/2, "Gamma:", 0);
+    if (!read_gamma(selected_ocon)) {
+        drw_text(drw, cw, y + bh, side_area, bh, lrpad/2, selected_ocon->info->crtc ? "  no gamma" : "  no crtc", 0);
+        return;
+    }
+
+    get_slider_bar(&bar_x, &bar_w);
+    for (i = 0; i < SliderLast; i++) {
+        y += bh;
+        v = *slider_value(selected_ocon, i);
+        fill = (int) (bar_w * (MAX(slider_min[i], MIN(slider_max[i], v)) - slider_min[i])
+                      / (slider_max[i] - slider_min[i]));
+
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        drw_text(drw, cw, y, bar_x - cw, bh, lrpad/2, slider_names[i], 0);
+        drw_setscheme(drw, i == grabbed_slider ? scheme[SchemeSel] : scheme[SchemeMon]);
+        drw_rect(drw, bar_x, y + bh/4, bar_w, bh/2, 1, 0);
+        drw_setscheme(drw, scheme[SchemeSel]);
+        drw_rect(drw, bar_x, y + bh/4, fill, bh/2, 1, 0);
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        snprintf(buf, sizeof(buf), "%.2f", v);
+        drw_text(drw, bar_x + bar_w, y, cw + side_area - bar_x - bar_w, bh, lrpad/2, buf, 0);
+    }
 }
 
 static void draw_modes() {
@@ -848,6 +1746,7 @@ static void draw(void) {
 
     if (selected_ocon) {
        draw_modes();
+       draw_gamma();
     } else {
         drw_text(drw, cw, (int) (bh*1.5), side_area, bh, lrpad/2, "  select output", 0);
 
@@ -926,7 +1825,11 @@ static void buttonpress(XButtonPressedEvent *e) {
             }
         }
 
-        if (x >= cw) {
+        if (x >= cw && selected_ocon && selected_ocon->ramp
+            && y >= get_gamma_start_y() + bh && y < get_gamma_start_y() + (SliderLast + 1) * bh) {
+            grabbed_slider = (y - get_gamma_start_y()) / bh - 1;
+            set_slider(x);
+        } else if (x >= cw) {
             start_y = get_modes_start_y();
             if (y < start_y && y >= start_y - bh) {
                 selected_mode = -1;
@@ -950,6 +1853,7 @@ static void buttonpress(XButtonPressedEvent *e) {
 static void buttonrelease(XButtonReleasedEvent *e) {
 
     if (e->button == 1) {
+        grabbed_slider = -1;
         if (grabbed_ocon) {
             selected_ocon = grabbed_ocon;
             selected_mode = 0;
@@ -967,6 +1871,8 @@ static void motion(XPointerMovedEvent *e) {
     if (grabbed_ocon) {
         grabbed_ocon->cx = x + grabbed_offset_x;
         grabbed_ocon->cy = y + grabbed_offset_y;
+    } else if (grabbed_slider >= 0 && selected_ocon) {
+        set_slider(x);
     } else {
         hovered_button = NULL;
         for (i = 0; i < LENGTH(buttons); i++) {
@@ -1066,7 +1972,11 @@ static void run(void) {
         }
 
         handle_events();
+        send_gamma();
         draw();
+        if (edids_unverified) {
+            validate_edid_cache();
+        }
 
         if (clock_gettime(CLOCK_MONOTONIC, &current) < 0) {
             die("clock_gettime:");
@@ -1276,7 +2186,14 @@ static void setup(void) {
     grab_focus();
     grab_keyboard();
 
-    sres = XRRGetScreenResources(dpy, root);
+    /* The server reports its configuration without probing, as long as the
+     * EDID cache matches it the first frame needs no probe and no EDID
+     * requests. validate_edid_cache() catches up after that frame. */
+    sres = XRRGetScreenResourcesCurrent(dpy, root);
+    if (sres && !load_edid_cache(sres)) {
+        XRRFreeScreenResources(sres);
+        sres = XRRGetScreenResources(dpy, root);
+    }
     if (!sres) {
         fprintf(stderr, "Could not get screen resources\n");
         return;
@@ -1285,6 +2202,10 @@ static void setup(void) {
     XRRSelectInput(dpy, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask | RROutputPropertyNotifyMask);
     XSync(dpy, False);
     get_outputs();
+    if (!edids_unverified) {
+        store_edid_cache();
+    }
+    create_crtc_windows();
 
     for (ocun = head; ocun; ocun = ocun->next) {
         if (ocun->crtc_info
@@ -1300,14 +2221,14 @@ static void setup(void) {
 
 static void
 usage(void) {
-    fputs("usage: drandr [-v]\n", stderr);
+    fputs("usage: drandr [-v] [-a] [-m monitor] [-fn font] [-nb color] [-nf color] [-sb color] [-sf color]\n", stderr);
     exit(1);
 }
 
 int
 main(int argc, char *argv[]) {
     XWindowAttributes wa;
-    int i;
+    int i, headless = 0;
     struct sigaction sa;
 
     for (i = 1; i < argc; i++) {
@@ -1317,7 +2238,9 @@ main(int argc, char *argv[]) {
             puts("daudio-"
                  VERSION);
             exit(0);
-        } else if (i + 1 == argc)
+        } else if (!strcmp(argv[i], "-a"))  /* apply the matching profile without gui */
+            headless = 1;
+        else if (i + 1 == argc)
             usage();
             /* these options take one argument */
         else if (!strcmp(argv[i], "-m"))
@@ -1354,6 +2277,13 @@ main(int argc, char *argv[]) {
     screen = DefaultScreen(dpy);
     root = RootWindow(dpy, screen);
 
+    if (headless) {
+        if (!(sres = XRRGetScreenResourcesCurrent(dpy, root)))
+            die("could not get screen resources");
+        get_outputs();
+        return apply_profile();
+    }
+
     parentWin = root;
     if (!XGetWindowAttributes(dpy, parentWin, &wa))
         die("could not get embedding window attributes: 0x%lx",
@@ -0,0 +1,336 @@
+/* See LICENSE file for copyright and license details. */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "edid.h"
+#include "util.h"
+
+#define DESCRIPTOR_SIZE  18
+#define TAG_CTA          0x02
+#define TAG_DISPLAYID    0x70
+#define CTA_EXTENDED     7
+#define CTA_HDR_STATIC   0x06
+#define DISPLAY_NAME     0xfc
+#define DISPLAY_SERIAL   0xff
+#define RANGE_LIMITS     0xfd
+#define CONTINUOUS_FREQ  0x01
+
+/* DisplayID 1.x and 2.0 data blocks */
+#define DID_PRODUCT      0x00
+#define DID_TIMING_I     0x03
+#define DID2_PRODUCT     0x20
+#define DID2_TIMING_VII  0x22
+#define DID2_ADAPTIVE    0x2b
+
+static const unsigned char header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+
+static uint16_t
+le16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t
+le24(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+}
+
+/* Checksum over a 128 byte block, zero for a valid one */
+static int
+checksum(const unsigned char *block)
+{
+	unsigned char sum = 0;
+	int i;
+
+	for (i = 0; i < EDID_BLOCK; i++)
+		sum += block[i];
+	return sum;
+}
+
+/* Copies descriptor text, which ends at a newline and is padded with spaces */
+static void
+copy_text(char *dst, const unsigned char *src, int len)
+{
+	int i;
+
+	if (len > EDID_TEXT_SIZE - 1)
+		len = EDID_TEXT_SIZE - 1;
+	for (i = 0; i < len && src[i] != '\n' && src[i]; i++)
+		dst[i] = src[i] >= 0x20 && src[i] < 0x7f ? src[i] : '?';
+	for (; i > 0 && dst[i - 1] == ' '; i--);
+	dst[i] = '\0';
+}
+
+static void
+set_refresh(EdidTiming *t)
+{
+	if (t->htotal && t->vtotal)
+		t->refresh = (uint64_t)t->clock * 1000000 / ((uint32_t)t->htotal * t->vtotal);
+}
+
+/* Detailed timing descriptor of the base block and CTA-861 extensions */
+static void
+detailed_timing(const unsigned char *d, Edid *edid)
+{
+	EdidTiming *t = &edid->preferred;
+	uint16_t wmm, hmm;
+
+	if (t->width)
+		return;
+	t->clock = le16(d) * 10;
+	t->width = d[2] | (d[4] & 0xf0) << 4;
+	t->htotal = t->width + (d[3] | (d[4] & 0x0f) << 8);
+	t->height = d[5] | (d[7] & 0xf0) << 4;
+	t->vtotal = t->height + (d[6] | (d[7] & 0x0f) << 8);
+	t->interlaced = !!(d[17] & 0x80);
+	set_refresh(t);
+	wmm = d[12] | (d[14] & 0xf0) << 4;
+	hmm = d[13] | (d[14] & 0x0f) << 8;
+	/* more precise than the centimeters of the base block */
+	if (wmm && hmm) {
+		edid->width_mm = wmm;
+		edid->height_mm = hmm;
+	}
+}
+
+static void
+descriptor(const unsigned char *d, int continuous, Edid *edid)
+{
+	if (d[0] || d[1]) {
+		detailed_timing(d, edid);
+		return;
+	}
+	switch (d[3]) {
+	case DISPLAY_NAME:
+		copy_text(edid->name, d + 5, 13);
+		break;
+	case DISPLAY_SERIAL:
+		copy_text(edid->serialstr, d + 5, 13);
+		break;
+	case RANGE_LIMITS:
+		/* only a continuous range can be driven at any rate in between */
+		if (continuous && !edid->vrr_max) {
+			edid->vrr_min = d[5] + ((d[4] & 0x03) == 0x03 ? 255 : 0);
+			edid->vrr_max = d[6] + ((d[4] & 0x02) ? 255 : 0);
+		}
+		break;
+	}
+}
+
+/* HDR static metadata, luminances are coded as in CTA-861.3 */
+static void
+hdr_static(const unsigned char *p, int len, Edid *edid)
+{
+	if (len < 3)
+		return;
+	edid->eotf = p[1] & 0x0f;
+	if (len >= 4 && p[3])
+		edid->max_luminance = 50 * pow(2, p[3] / 32.0);
+	if (len >= 5 && p[4])
+		edid->max_fall = 50 * pow(2, p[4] / 32.0);
+	if (len >= 6 && edid->max_luminance)
+		edid->min_luminance = edid->max_luminance * (p[5] / 255.0) * (p[5] / 255.0) / 100;
+}
+
+static void
+cta_block(const unsigned char *b, Edid *edid)
+{
+	int dtd = b[2], i, tag, len;
+
+	if (dtd < 4 || dtd > EDID_BLOCK - 1)
+		return;
+	for (i = 4; i < dtd; i += 1 + len) {
+		tag = b[i] >> 5;
+		len = b[i] & 0x1f;
+		if (i + 1 + len > dtd)
+			break;
+		if (tag == CTA_EXTENDED && len >= 1 && b[i + 1] == CTA_HDR_STATIC)
+			hdr_static(b + i + 1, len, edid);
+	}
+	for (i = dtd; i + DESCRIPTOR_SIZE <= EDID_BLOCK - 1 && (b[i] || b[i + 1]); i += DESCRIPTOR_SIZE)
+		detailed_timing(b + i, edid);
+}
+
+/* Type I and type VII timings share their layout, only the clock unit differs.
+ * Takes the one flagged preferred, else the first. */
+static void
+displayid_timing(const unsigned char *p, int len, uint32_t unit, Edid *edid)
+{
+	EdidTiming *t = &edid->preferred;
+	int i;
+
+	if (t->width || len < 20)
+		return;
+	for (i = 0; i + 20 <= len && !(p[i + 3] & 0x80); i += 20);
+	if (i + 20 > len)
+		i = 0;
+	p += i;
+	t->clock = (le24(p) + 1) * unit;
+	t->interlaced = !!(p[3] & 0x10);
+	t->width = le16(p + 4) + 1;
+	t->htotal = t->width + le16(p + 6) + 1;
+	t->height = le16(p + 12) + 1;
+	t->vtotal = t->height + le16(p + 14) + 1;
+	set_refresh(t);
+}
+
+static void
+displayid_block(const unsigned char *b, Edid *edid)
+{
+	const unsigned char *p;
+	int end, i, len;
+
+	/* b[1] version, b[2] payload bytes, b[3] product type, b[4] extension count */
+	end = 5 + b[2];
+	if (end > EDID_BLOCK - 1)
+		end = EDID_BLOCK - 1;
+	for (i = 5; i + 3 <= end && b[i]; i += 3 + len) {
+		len = b[i + 2];
+		if (i + 3 + len > end)
+			break;
+		p = b + i + 3;
+		switch (b[i]) {
+		case DID_PRODUCT:
+		case DID2_PRODUCT:
+			if (len >= 12 && !edid->name[0] && p[11] && 12 + p[11] <= len)
+				copy_text(edid->name, p + 12, p[11]);
+			break;
+		case DID_TIMING_I:
+			displayid_timing(p, len, 10, edid);
+			break;
+		case DID2_TIMING_VII:
+			displayid_timing(p, len, 1, edid);
+			break;
+		case DID2_ADAPTIVE:
+			if (len >= 6 && !edid->vrr_max) {
+				edid->vrr_min = p[2];
+				edid->vrr_max = (p[3] | (p[4] & 0x03) << 8) + 1;
+			}
+			break;
+		}
+	}
+}
+
+int
+edid_parse(const unsigned char *data, int len, Edid *edid)
+{
+	const unsigned char *b;
+	int i, n, continuous;
+
+	memset(edid, 0, sizeof(Edid));
+	if (len < EDID_BLOCK || memcmp(data, header, sizeof(header)))
+		return 0;
+	edid_digest(data, len, &edid->id);
+	edid->vendor = data[8] << 8 | data[9];
+	edid->product = le16(data + 10);
+	edid->serial = (uint32_t)le16(data + 12) | (uint32_t)le16(data + 14) << 16;
+	edid->pnp[0] = '@' + (edid->vendor >> 10 & 0x1f);
+	edid->pnp[1] = '@' + (edid->vendor >> 5 & 0x1f);
+	edid->pnp[2] = '@' + (edid->vendor & 0x1f);
+	edid->width_mm = data[21] * 10;
+	edid->height_mm = data[22] * 10;
+	/* range limits are a promise only with the continuous frequency bit */
+	continuous = data[24] & CONTINUOUS_FREQ;
+	for (i = 54; i < 126; i += DESCRIPTOR_SIZE)
+		descriptor(data + i, continuous, edid);
+
+	n = MIN(data[126], len / EDID_BLOCK - 1);
+	edid->nextensions = n;
+	for (i = 1; i <= n; i++) {
+		b = data + i * EDID_BLOCK;
+		if (checksum(b))
+			continue;
+		if (b[0] == TAG_CTA)
+			cta_block(b, edid);
+		else if (b[0] == TAG_DISPLAYID)
+			displayid_block(b, edid);
+	}
+	return 1;
+}
+
+unsigned char *
+edid_get(Display *dpy, RROutput output, int *len)
+{
+	Atom atom, real;
+	unsigned char *p = NULL;
+	unsigned long n, extra;
+	int format;
+
+	/* Xlib caches atoms, only the first call per display asks the server */
+	atom = XInternAtom(dpy, RR_PROPERTY_RANDR_EDID, False);
+	/* 128 longs hold the base block and three extensions, larger blobs
+	 * take a second request. A missing property comes back empty. */
+	if (XRRGetOutputProperty(dpy, output, atom, 0L, 128L, False, False,
+	                         AnyPropertyType, &real, &format, &n, &extra, &p) != Success)
+		return NULL;
+	if (real != None && extra) {
+		XFree(p);
+		p = NULL;
+		if (XRRGetOutputProperty(dpy, output, atom, 0L, 128L + (extra + 3) / 4, False, False,
+		                         AnyPropertyType, &real, &format, &n, &extra, &p) != Success)
+			return NULL;
+	}
+	if (real == None || format != 8 || n < EDID_BLOCK || memcmp(p, header, sizeof(header))) {
+		if (p)
+			XFree(p);
+		return NULL;
+	}
+	*len = n;
+	return p;
+}
+
+static uint64_t
+rotl(uint64_t x, int r)
+{
+	return x << r | x >> (64 - r);
+}
+
+/* Finalizer of MurmurHash3, every input bit affects every output bit */
+static uint64_t
+fmix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Two lanes of MurmurHash3 x64 style mixing over 8 byte words. EDIDs are
+ * whole 128 byte blocks, so the tail only matters for broken blobs. Words
+ * are read in host byte order, digests are not meant to leave the machine.
+ */
+void
+edid_digest(const unsigned char *data, int len, EdidDigest *digest)
+{
+	uint64_t a = 0x9e3779b97f4a7c15ULL ^ (uint64_t)len, b = 0xc2b2ae3d27d4eb4fULL, w;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, data + i, sizeof(w));
+		a = rotl(a ^ w * 0x87c37b91114253d5ULL, 31) * 5 + 0x52dce729;
+		b = rotl(b ^ w * 0x4cf5ad432745937fULL, 33) * 5 + 0x38495ab5;
+	}
+	w = 0;
+	memcpy(&w, data + i, len - i);
+	a ^= w * 0x87c37b91114253d5ULL;
+	b ^= rotl(w, 32) * 0x4cf5ad432745937fULL;
+	a += b;
+	b += a;
+	digest->lo = fmix(a);
+	digest->hi = fmix(b) + digest->lo;
+}
+
+char *
+edid_digest_hex(const EdidDigest *digest, char *hex)
+{
+	snprintf(hex, 33, "%016llx%016llx", (unsigned long long)digest->hi, (unsigned long long)digest->lo);
+	return hex;
+}
@@ -0,0 +1,52 @@
+/* See LICENSE file for copyright and license details. */
+
+#define EDID_BLOCK     128
+#define EDID_TEXT_SIZE 14 /* 13 characters of a display descriptor and the terminator */
+
+/* 128 bit digest of an EDID blob, the identity outputs are told apart by */
+typedef struct {
+	uint64_t lo, hi;
+} EdidDigest;
+
+#define EDID_SAME(A, B) ((A).lo == (B).lo && (A).hi == (B).hi)
+
+/* Transfer functions of the CTA-861 HDR static metadata block */
+enum { EdidSDR = 1, EdidHDR = 2, EdidPQ = 4, EdidHLG = 8 };
+
+typedef struct {
+	uint32_t clock;           /* kHz */
+	uint16_t width, height;
+	uint16_t htotal, vtotal;
+	uint32_t refresh;         /* mHz, of a field when interlaced */
+	uint8_t interlaced;
+} EdidTiming;
+
+/* What the base block and the CTA-861 and DisplayID extensions tell about a monitor */
+typedef struct {
+	EdidDigest id;            /* edid_digest() of the whole blob */
+	uint16_t vendor;          /* manufacturer id as stored, big endian */
+	uint16_t product;
+	uint32_t serial;
+	char pnp[4];              /* manufacturer id as three letters */
+	char name[EDID_TEXT_SIZE];
+	char serialstr[EDID_TEXT_SIZE];
+	uint16_t width_mm, height_mm;
+	EdidTiming preferred;     /* width 0 without one */
+	uint16_t vrr_min, vrr_max; /* Hz, 0 without a variable refresh range */
+	uint8_t eotf;             /* Edid* bits, 0 without HDR metadata */
+	float max_luminance, max_fall, min_luminance; /* cd/m2, 0 if not given */
+	uint8_t nextensions;      /* extension blocks in the blob */
+} Edid;
+
+/* Full EDID property of output, all extension blocks included. Returns NULL
+ * without a valid base block, the blob is freed with XFree(). */
+unsigned char *edid_get(Display *dpy, RROutput output, int *len);
+
+/* Parses len bytes of EDID. Returns 0 if the base block is invalid, broken
+ * extension blocks are skipped. */
+int edid_parse(const unsigned char *data, int len, Edid *edid);
+
+void edid_digest(const unsigned char *data, int len, EdidDigest *digest);
+
+/* Writes the digest as 32 hex digits and a terminator to hex, for logs */
+char *edid_digest_hex(const EdidDigest *digest, char *hex);
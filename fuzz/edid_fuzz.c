@@ -0,0 +1,37 @@
+/* See LICENSE file for copyright and license details.
+ *
+ * libFuzzer entry point for edid_parse(), see make fuzz. The header is
+ * written over the first bytes of the input, so inputs are not wasted on
+ * the check every EDID has to pass first.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "../edid.h"
+
+#define MAX_INPUT (256 * EDID_BLOCK) /* the extension count is one byte */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static const unsigned char header[8] = { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00 };
+	unsigned char *buf;
+	char hex[33];
+	Edid edid;
+
+	if (size > MAX_INPUT || !(buf = malloc(size ? size : 1)))
+		return 0;
+	memcpy(buf, data, size);
+	if (size >= sizeof(header))
+		memcpy(buf, header, sizeof(header));
+	/* an exact size buffer lets ASan catch reads past the blob */
+	if (edid_parse(buf, (int)size, &edid))
+		edid_digest_hex(&edid.id, hex);
+	free(buf);
+	return 0;
+}
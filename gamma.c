@@ -0,0 +1,289 @@
+/* See LICENSE file for copyright and license details. */
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gamma.h"
+
+#define BLOCK       256
+#define LN2         0.69314718055994530942
+#define TWO52       4503599627370496.0
+#define MANTISSA    0x000fffffffffffffULL
+#define SQRT2_MANT  0x0006a09e667f3bcdULL /* mantissa bits of sqrt(2) */
+#define ROUND_MAGIC 6755399441055744.0 /* 1.5 * 2^52, adding it leaves round(y) in the low bits */
+#define LOG2_ZERO   -1e7 /* log2(0), times 1/gamma still far below -1022 for any sane gamma */
+
+/*
+ * pow() per entry and channel is what made ramps expensive. The ramp is
+ * x^(1/g) * b, so log2(x) is computed once per entry for all channels and
+ * each channel only needs one exp2. Both are polynomials on the bits of the
+ * double without libm calls or branches, so the inner loops vectorize.
+ * Their error is below 1e-9, far under the 1/65535 of one ramp step.
+ * Floating point compares may trap and keep compilers from vectorizing,
+ * so clamps are written with fabs() and decisions made on integer bits.
+ */
+
+/* max(a, b) without a compare, exact when b is 0 */
+#define FMAX(A, B) (((A) + (B) + fabs((A) - (B))) * 0.5)
+
+static double
+bits_double(uint64_t u)
+{
+	double d;
+
+	memcpy(&d, &u, sizeof(d));
+	return d;
+}
+
+static uint64_t
+double_bits(double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof(u));
+	return u;
+}
+
+/* log2 of a normal x >= 0, log2(0) comes out as about LOG2_ZERO */
+static double
+fast_log2(double x)
+{
+	uint64_t u = double_bits(x), big, zero;
+	double e, m, s, s2;
+
+	/* move the mantissa into [sqrt(1/2), sqrt(2)) where the series converges
+	 * fast, big is 1 when it has to be halved */
+	big = ((u & MANTISSA) + ((1ULL << 52) - SQRT2_MANT)) >> 52;
+	m = bits_double((u & MANTISSA) | ((0x3ffULL - big) << 52));
+	/* biased exponent to double through the mantissa, no integer conversion */
+	e = bits_double(0x4330000000000000ULL | ((u >> 52) + big)) - TWO52 - 1023;
+	/* ln(m) = 2 atanh(s) */
+	s = (m - 1) / (m + 1);
+	s2 = s * s;
+	/* 0 has a zero exponent field and would give only -1023, which large
+	 * gammas scale back up to visible levels. zero is all ones for it. */
+	zero = 0 - (((u >> 52) - 1) >> 63);
+	e += bits_double(double_bits(LOG2_ZERO) & zero);
+	return e + 2 / LN2 * s * (1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7
+	                           + s2 * (1.0 / 9 + s2 * (1.0 / 11))))));
+}
+
+/* 2^y for y <= 0, anything below 2^-1022 is as good as zero for a ramp */
+static double
+fast_exp2(double y)
+{
+	double d, n, t, scale;
+
+	y = FMAX(y, -1022.0);
+	d = y + ROUND_MAGIC;
+	n = d - ROUND_MAGIC;
+	/* n + 1023 ends up in the exponent field, the rest of the bits shift out */
+	scale = bits_double((double_bits(d) + 1023) << 52);
+	t = (y - n) * LN2;
+	return scale * (1 + t * (1 + t * (1.0 / 2 + t * (1.0 / 6 + t * (1.0 / 24 + t * (1.0 / 120
+	                + t * (1.0 / 720 + t * (1.0 / 5040 + t * (1.0 / 40320)))))))));
+}
+
+void
+gamma_ramp(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+           double gred, double ggreen, double gblue, double brightness)
+{
+	unsigned short *ramp[3];
+	double lx[BLOCK], e[3], last, v;
+	int i, j, c, n, linear[3];
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	e[0] = 1.0 / (gred != 0.0 ? gred : 1.0);
+	e[1] = 1.0 / (ggreen != 0.0 ? ggreen : 1.0);
+	e[2] = 1.0 / (gblue != 0.0 ? gblue : 1.0);
+	last = size > 1 ? size - 1 : 1;
+
+	/* identity ramps keep the exact linear values */
+	for (c = 0; c < 3; c++) {
+		if ((linear[c] = e[c] == 1.0 && brightness == 1.0)) {
+			for (i = 0; i < size; i++) {
+				ramp[c][i] = (double)i / last * 65535.0;
+			}
+		}
+	}
+	if (linear[0] && linear[1] && linear[2]) {
+		return;
+	}
+
+	for (i = 0; i < size; i += BLOCK) {
+		n = size - i < BLOCK ? size - i : BLOCK;
+		for (j = 0; j < n; j++) {
+			lx[j] = fast_log2((double)(i + j) / last);
+		}
+		for (c = 0; c < 3; c++) {
+			if (linear[c]) {
+				continue;
+			}
+			for (j = 0; j < n; j++) {
+				v = fast_exp2(e[c] * lx[j]) * brightness;
+				/* clamp to [0, 1], saturated entries come out as exactly 1 */
+				v = FMAX(v, 0.0);
+				v = 1.0 - FMAX(1.0 - v, 0.0);
+				ramp[c][i + j] = v * 65535.0;
+			}
+		}
+	}
+}
+
+/* Index of the last entry below 0xffff */
+static int
+last_unclamped(const unsigned short *ramp, int size)
+{
+	int i;
+
+	for (i = size - 1; i > 0 && ramp[i] == 0xffff; i--);
+	return i;
+}
+
+/*
+ * With v = x^e * b, b follows from two points (x1, v1) and (x2, v2):
+ * b = e^((ln(v2) ln(x1) - ln(v1) ln(x2)) / ln(x1/x2)) and then
+ * e = (ln(v) - ln(b)) / ln(x). x2 is the last entry that is not clamped
+ * on the channel reaching furthest, x1 half of it.
+ */
+void
+gamma_fit(const unsigned short *red, const unsigned short *green, const unsigned short *blue, int size,
+          double exponent[3], double *brightness)
+{
+	const unsigned short *ramp[3], *best;
+	double x1, v1, x2, v2;
+	int last[3], lbest, middle, c;
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	best = red;
+	lbest = 0;
+	for (c = 0; c < 3; c++) {
+		last[c] = last_unclamped(ramp[c], size);
+		if (c == 0 || last[c] > lbest) {
+			lbest = last[c];
+			best = ramp[c];
+		}
+	}
+	if (lbest == 0) {
+		lbest = 1;
+	}
+
+	middle = lbest / 2;
+	x1 = (double)(middle + 1) / size;
+	v1 = (double)best[middle] / 65535;
+	x2 = (double)(lbest + 1) / size;
+	v2 = (double)best[lbest] / 65535;
+	if (v2 < 0.0001) { /* black screen */
+		*brightness = 0;
+		exponent[0] = exponent[1] = exponent[2] = 1;
+		return;
+	}
+	if (lbest + 1 == size) {
+		*brightness = v2;
+	} else {
+		*brightness = exp((log(v2) * log(x1) - log(v1) * log(x2)) / log(x1 / x2));
+	}
+	for (c = 0; c < 3; c++) {
+		exponent[c] = log((double)ramp[c][last[c] / 2] / *brightness / 65535)
+		              / log((double)(last[c] / 2 + 1) / size);
+	}
+}
+
+/* Fit of the Planckian locus in sRGB by Tanner Helland, t in 100K */
+static void
+blackbody(double t, double rgb[3])
+{
+	int c;
+
+	if (t <= 66) {
+		rgb[0] = 1;
+		rgb[1] = 0.3900815787690196 * log(t) - 0.6318414437886275;
+	} else {
+		rgb[0] = 1.292936186062745 * pow(t - 60, -0.1332047592);
+		rgb[1] = 1.129890860895294 * pow(t - 60, -0.0755148492);
+	}
+	if (t >= 66) {
+		rgb[2] = 1;
+	} else if (t <= 19) {
+		rgb[2] = 0;
+	} else {
+		rgb[2] = 0.5432067891101961 * log(t - 10) - 1.19625408914;
+	}
+	for (c = 0; c < 3; c++) {
+		rgb[c] = rgb[c] < 0 ? 0 : rgb[c] > 1 ? 1 : rgb[c];
+	}
+}
+
+void
+gamma_blackbody(double kelvin, double white[3])
+{
+	double neutral[3];
+	int c;
+
+	kelvin = kelvin < 1000 ? 1000 : kelvin > 25000 ? 25000 : kelvin;
+	blackbody(65, neutral);
+	blackbody(kelvin / 100, white);
+	for (c = 0; c < 3; c++) {
+		white[c] /= neutral[c];
+		white[c] = white[c] > 1 ? 1 : white[c];
+	}
+}
+
+void
+gamma_white(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+            const unsigned short white[3])
+{
+	unsigned short *ramp[3];
+	uint32_t last = size > 1 ? size - 1 : 1;
+	int i, c;
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < size; i++) {
+			ramp[c][i] = (uint32_t)i * white[c] / last;
+		}
+	}
+}
+
+/*
+ * Linear interpolation between the n >= 2 points of src. The last segment
+ * is used up to its end instead of reading past it, so the loop has no
+ * branches and vectorizes where the target can gather.
+ */
+void
+gamma_resample(const double *src, int n, unsigned short *dst, int size)
+{
+	double step = size > 1 ? (double)(n - 1) / (size - 1) : 0, pos, f;
+	int i, k;
+
+	for (i = 0; i < size; i++) {
+		pos = i * step;
+		k = (int)pos;
+		k = k < n - 2 ? k : n - 2;
+		f = pos - k;
+		dst[i] = src[k] + (src[k + 1] - src[k]) * f + 0.5;
+	}
+}
+
+void
+gamma_scale(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+            const unsigned short white[3])
+{
+	unsigned short *ramp[3];
+	int i, c;
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < size; i++) {
+			ramp[c][i] = (uint32_t)ramp[c][i] * white[c] / 65535;
+		}
+	}
+}
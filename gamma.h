@@ -0,0 +1,27 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Fills the three size entry ramps like xrandr --gamma r:g:b --brightness b.
+ * Gamma values of 0 count as 1, size is at most 65536. */
+void gamma_ramp(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+                double gred, double ggreen, double gblue, double brightness);
+
+/* Fits the ramps with x^e * b like xrandr --verbose does, e is 1/gamma of
+ * gamma_ramp(). Black ramps come out as brightness 0 and exponents 1. */
+void gamma_fit(const unsigned short *red, const unsigned short *green, const unsigned short *blue, int size,
+               double exponent[3], double *brightness);
+
+/* White point of a blackbody at kelvin, scaled so 6500K is 1:1:1 */
+void gamma_blackbody(double kelvin, double white[3]);
+
+/* Fills linear ramps ending at the 16 bit white point, the entries only
+ * depend on white, so equal white points give equal ramps */
+void gamma_white(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+                 const unsigned short white[3]);
+
+/* Scales the ramps in place so they end at the 16 bit white point */
+void gamma_scale(unsigned short *red, unsigned short *green, unsigned short *blue, int size,
+                 const unsigned short white[3]);
+
+/* Resamples the n >= 2 entries of src, 16 bit values as doubles, to size
+ * entries by linear interpolation, the first and last entries are kept */
+void gamma_resample(const double *src, int n, unsigned short *dst, int size);
@@ -0,0 +1,224 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gamma.h"
+#include "icc.h"
+#include "util.h"
+
+#define ICC_HEADER_SIZE 128
+#define ICC_TAG_SIZE    12
+#define ICC_MAX_SIZE    (64 << 20)
+#define SIG_VCGT        0x76636774 /* 'vcgt' */
+#define VCGT_TABLE      0
+#define VCGT_FORMULA    1
+#define CACHE_PATH_SIZE (4096 + 32) /* cache directory and file name */
+
+static uint32_t
+be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint16_t
+be16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+/* Directory of the ramp cache, NULL without $XDG_CACHE_HOME and $HOME */
+static const char *
+cache_dir(void)
+{
+	static char dir[4096];
+	const char *base;
+
+	if (dir[0])
+		return dir;
+	if ((base = getenv("XDG_CACHE_HOME")) && base[0])
+		snprintf(dir, sizeof(dir), "%s/drandr/vcgt", base);
+	else if ((base = getenv("HOME")))
+		snprintf(dir, sizeof(dir), "%s/.cache/drandr/vcgt", base);
+	else
+		return NULL;
+	return dir;
+}
+
+static int
+cache_file(char *buf, size_t len, const char *path, const struct stat *st, int size)
+{
+	uint64_t h;
+
+	if (!cache_dir())
+		return 0;
+	h = fnv1a(FNV_OFFSET, path, strlen(path));
+	h = fnv1a(h, &st->st_mtime, sizeof(st->st_mtime));
+	h = fnv1a(h, &st->st_size, sizeof(st->st_size));
+	h = fnv1a(h, &size, sizeof(size));
+	return snprintf(buf, len, "%s/%016llx", cache_dir(), (unsigned long long)h) < (int)len;
+}
+
+static int
+read_cache(const char *file, int size, unsigned short *ramp[3])
+{
+	IccCacheHeader hdr;
+	FILE *fp;
+	int c, ok;
+
+	if (!(fp = fopen(file, "r")))
+		return 0;
+	ok = fread(&hdr, sizeof(hdr), 1, fp) == 1
+	     && !memcmp(hdr.magic, ICC_CACHE_MAGIC, sizeof(hdr.magic))
+	     && hdr.version == ICC_CACHE_VERSION && hdr.size == (uint32_t)size;
+	for (c = 0; ok && c < 3; c++)
+		ok = fread(ramp[c], sizeof(unsigned short), size, fp) == (size_t)size;
+	fclose(fp);
+	return ok;
+}
+
+static void
+write_cache(const char *file, int size, unsigned short *ramp[3])
+{
+	IccCacheHeader hdr;
+	char tmp[CACHE_PATH_SIZE + 4];
+	FILE *fp;
+	int c, ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ICC_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = ICC_CACHE_VERSION;
+	hdr.size = size;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp))
+		return;
+	if (mkdirs(tmp) < 0 || !(fp = fopen(tmp, "w")))
+		return;
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	for (c = 0; ok && c < 3; c++)
+		ok = fwrite(ramp[c], sizeof(unsigned short), size, fp) == (size_t)size;
+	if (fclose(fp) == EOF || !ok || rename(tmp, file) < 0)
+		unlink(tmp);
+}
+
+/* Table type: channels, entry count and entry size, then the entries of
+ * each channel one after another. A single channel applies to all three. */
+static int
+vcgt_table(const unsigned char *t, uint32_t len, int size, unsigned short *ramp[3])
+{
+	double *src;
+	uint32_t channels, count, bytes, i;
+	const unsigned char *p;
+	int c;
+
+	if (len < 18)
+		return 0;
+	channels = be16(t + 12);
+	count = be16(t + 14);
+	bytes = be16(t + 16);
+	if ((channels != 1 && channels != 3) || count < 2 || (bytes != 1 && bytes != 2)
+	    || 18 + channels * count * bytes > len)
+		return 0;
+	if (!(src = malloc(count * sizeof(double))))
+		return 0;
+	for (c = 0; c < 3; c++) {
+		p = t + 18 + (channels == 1 ? 0 : c) * count * bytes;
+		for (i = 0; i < count; i++)
+			src[i] = bytes == 1 ? p[i] * 257.0 : be16(p + 2 * i);
+		gamma_resample(src, count, ramp[c], size);
+	}
+	free(src);
+	return 1;
+}
+
+/* Formula type: gamma, min and max per channel as s15Fixed16 */
+static int
+vcgt_formula(const unsigned char *t, uint32_t len, int size, unsigned short *ramp[3])
+{
+	double g, lo, hi, v, last = size > 1 ? size - 1 : 1;
+	int c, i;
+
+	if (len < 48)
+		return 0;
+	for (c = 0; c < 3; c++) {
+		g = (int32_t)be32(t + 12 + 12 * c) / 65536.0;
+		lo = (int32_t)be32(t + 16 + 12 * c) / 65536.0;
+		hi = (int32_t)be32(t + 20 + 12 * c) / 65536.0;
+		for (i = 0; i < size; i++) {
+			v = lo + (hi - lo) * pow(i / last, g);
+			v = v < 0 ? 0 : v > 1 ? 1 : v;
+			ramp[c][i] = v * 65535 + 0.5;
+		}
+	}
+	return 1;
+}
+
+static int
+parse_vcgt(const unsigned char *icc, size_t len, int size, unsigned short *ramp[3])
+{
+	const unsigned char *tag;
+	uint32_t ntag, i, off, tlen;
+
+	if (len < ICC_HEADER_SIZE + 4)
+		return 0;
+	ntag = be32(icc + ICC_HEADER_SIZE);
+	if (ntag > (len - ICC_HEADER_SIZE - 4) / ICC_TAG_SIZE)
+		return 0;
+	for (i = 0; i < ntag; i++) {
+		tag = icc + ICC_HEADER_SIZE + 4 + i * ICC_TAG_SIZE;
+		if (be32(tag) != SIG_VCGT)
+			continue;
+		off = be32(tag + 4);
+		tlen = be32(tag + 8);
+		if (off > len || tlen > len - off || tlen < 12 || be32(icc + off) != SIG_VCGT)
+			return 0;
+		switch (be32(icc + off + 8)) {
+		case VCGT_TABLE:
+			return vcgt_table(icc + off, tlen, size, ramp);
+		case VCGT_FORMULA:
+			return vcgt_formula(icc + off, tlen, size, ramp);
+		}
+		return 0;
+	}
+	return 0;
+}
+
+int
+icc_load_vcgt(const char *path, int size, unsigned short *red, unsigned short *green, unsigned short *blue)
+{
+	unsigned short *ramp[3];
+	struct stat st;
+	char file[CACHE_PATH_SIZE];
+	void *map;
+	int fd, ok, cached;
+
+	ramp[0] = red;
+	ramp[1] = green;
+	ramp[2] = blue;
+	if (size < 2 || (fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size > ICC_MAX_SIZE) {
+		close(fd);
+		return 0;
+	}
+	cached = cache_file(file, sizeof(file), path, &st, size);
+	if (cached && read_cache(file, size, ramp)) {
+		close(fd);
+		return 1;
+	}
+
+	map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	ok = parse_vcgt(map, st.st_size, size, ramp);
+	munmap(map, st.st_size);
+	if (ok && cached)
+		write_cache(file, size, ramp);
+	return ok;
+}
@@ -0,0 +1,17 @@
+/* See LICENSE file for copyright and license details. */
+
+#define ICC_CACHE_MAGIC   "DRVCGT"
+#define ICC_CACHE_VERSION 1
+
+/* On disk: header followed by the red, green and blue ramps of size entries
+ * in host byte order. Files are keyed by profile path, mtime, length and size. */
+typedef struct {
+	char magic[6];
+	uint16_t version;
+	uint32_t size;
+} IccCacheHeader;
+
+/* Fills the three size entry ramps with the vcgt calibration of the ICC
+ * profile at path, from the ramp cache unless the profile changed since.
+ * Returns 0 if the profile can not be read or has no usable vcgt tag. */
+int icc_load_vcgt(const char *path, int size, unsigned short *red, unsigned short *green, unsigned short *blue);
@@ -0,0 +1,250 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "profile.h"
+#include "util.h"
+
+#define BYTEORDER 0x01020304
+
+static char path[4096];
+
+static int
+cmpoutput(const void *a, const void *b)
+{
+	uint64_t x = ((const ProfileOutput *)a)->edid, y = ((const ProfileOutput *)b)->edid;
+
+	return (x > y) - (x < y);
+}
+
+static int
+cmpindex(const void *a, const void *b)
+{
+	uint64_t x = ((const ProfileIndex *)a)->key, y = ((const ProfileIndex *)b)->key;
+
+	return (x > y) - (x < y);
+}
+
+static int
+sameset(const Profile *a, const Profile *b)
+{
+	uint32_t i;
+
+	if (a->key != b->key || a->noutput != b->noutput)
+		return 0;
+	for (i = 0; i < a->noutput; i++)
+		if (a->outputs[i].edid != b->outputs[i].edid)
+			return 0;
+	return 1;
+}
+
+const char *
+profiledb_path(void)
+{
+	const char *base;
+
+	if (path[0])
+		return path;
+	if ((base = getenv("XDG_CONFIG_HOME")) && base[0])
+		snprintf(path, sizeof(path), "%s/drandr/profiles.db", base);
+	else if ((base = getenv("HOME")))
+		snprintf(path, sizeof(path), "%s/.config/drandr/profiles.db", base);
+	else
+		return NULL;
+	return path;
+}
+
+/* Maps the database read only. A missing or invalid file opens as an empty database. */
+int
+profiledb_open(ProfileDB *db, const char *file)
+{
+	struct stat st;
+	const ProfileHeader *hdr;
+	int fd;
+
+	memset(db, 0, sizeof(ProfileDB));
+	if (!file || (fd = open(file, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ProfileHeader)) {
+		close(fd);
+		return -1;
+	}
+	db->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (db->map == MAP_FAILED) {
+		db->map = NULL;
+		return -1;
+	}
+	db->size = st.st_size;
+
+	hdr = db->map;
+	if (memcmp(hdr->magic, PROFILE_MAGIC, sizeof(hdr->magic))
+	    || hdr->version != PROFILE_VERSION || hdr->byteorder != BYTEORDER
+	    || hdr->record_size != sizeof(Profile)
+	    || db->size != sizeof(ProfileHeader) + hdr->nprofile * (sizeof(ProfileIndex) + sizeof(Profile))) {
+		profiledb_close(db);
+		return -1;
+	}
+	db->hdr = hdr;
+	db->index = (const ProfileIndex *)(hdr + 1);
+	db->records = (const Profile *)(db->index + hdr->nprofile);
+	return 0;
+}
+
+void
+profiledb_close(ProfileDB *db)
+{
+	if (db->map)
+		munmap(db->map, db->size);
+	memset(db, 0, sizeof(ProfileDB));
+}
+
+/* Binary search over the index, key has to be finished with profile_finish() */
+const Profile *
+profiledb_find(const ProfileDB *db, const Profile *key)
+{
+	const Profile *p;
+	uint32_t lo = 0, hi, mid;
+
+	if (!db->hdr)
+		return NULL;
+	hi = db->hdr->nprofile;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (db->index[mid].key < key->key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	/* equal keys of different monitor sets are adjacent */
+	for (; lo < db->hdr->nprofile && db->index[lo].key == key->key; lo++) {
+		if (db->index[lo].record >= db->hdr->nprofile)
+			break;
+		p = &db->records[db->index[lo].record];
+		if (sameset(p, key))
+			return p;
+	}
+	return NULL;
+}
+
+static int
+writedb(const char *file, const Profile *records, uint32_t n)
+{
+	ProfileHeader hdr;
+	ProfileIndex *index;
+	FILE *fp;
+	char tmp[4096 + 8];
+	uint32_t i;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	if (!(fp = fopen(tmp, "w")))
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PROFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = PROFILE_VERSION;
+	hdr.byteorder = BYTEORDER;
+	hdr.record_size = sizeof(Profile);
+	hdr.nprofile = n;
+
+	index = ecalloc(n ? n : 1, sizeof(ProfileIndex));
+	for (i = 0; i < n; i++) {
+		index[i].key = records[i].key;
+		index[i].record = i;
+	}
+	qsort(index, n, sizeof(ProfileIndex), cmpindex);
+
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+	     && fwrite(index, sizeof(ProfileIndex), n, fp) == n
+	     && fwrite(records, sizeof(Profile), n, fp) == n
+	     && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	free(index);
+	if (fclose(fp) == EOF || !ok || rename(tmp, file) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Replaces the profile of the same monitor set or adds a new one. The new
+ * database is written next to the old one and renamed over it, so readers
+ * always map a complete file. Writers are serialized with a lock file. */
+int
+profiledb_store(const char *file, const Profile *p)
+{
+	ProfileDB db;
+	Profile *records;
+	const Profile *old;
+	char lock[4096 + 8];
+	uint32_t n;
+	int lockfd, ret;
+
+	if (!file)
+		return -1;
+	snprintf(lock, sizeof(lock), "%s.lock", file);
+	if (mkdirs(lock) < 0 || (lockfd = open(lock, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	flock(lockfd, LOCK_EX);
+
+	profiledb_open(&db, file);
+	n = db.hdr ? db.hdr->nprofile : 0;
+	records = ecalloc(n + 1, sizeof(Profile));
+	if (n)
+		memcpy(records, db.records, n * sizeof(Profile));
+	if ((old = profiledb_find(&db, p)))
+		records[old - db.records] = *p;
+	else
+		records[n++] = *p;
+	profiledb_close(&db);
+
+	ret = writedb(file, records, n);
+	free(records);
+	flock(lockfd, LOCK_UN);
+	close(lockfd);
+	return ret;
+}
+
+/* FNV-1a of the EDID as lowercase hex, which earlier versions keyed
+ * profiles by, computed from the bytes without building the string */
+uint64_t
+profile_edid_hash(const unsigned char *edid, int len)
+{
+	static const char digits[] = "0123456789abcdef";
+	uint64_t h = FNV_OFFSET;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)digits[edid[i] >> 4]) * FNV_PRIME;
+		h = (h ^ (unsigned char)digits[edid[i] & 0x0f]) * FNV_PRIME;
+	}
+	return h;
+}
+
+/* Sorts the outputs and computes the key of the monitor set */
+void
+profile_finish(Profile *p)
+{
+	uint32_t i;
+
+	qsort(p->outputs, p->noutput, sizeof(ProfileOutput), cmpoutput);
+	p->key = FNV_OFFSET;
+	for (i = 0; i < p->noutput; i++)
+		p->key = fnv1a(p->key, &p->outputs[i].edid, sizeof(p->outputs[i].edid));
+}
+
+const ProfileOutput *
+profile_output(const Profile *p, uint64_t edid)
+{
+	ProfileOutput key;
+
+	key.edid = edid;
+	return bsearch(&key, p->outputs, p->noutput, sizeof(ProfileOutput), cmpoutput);
+}
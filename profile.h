@@ -0,0 +1,59 @@
+/* See LICENSE file for copyright and license details. */
+
+#define PROFILE_MAGIC       "DRPROFDB"
+#define PROFILE_VERSION     1
+#define PROFILE_MAX_OUTPUTS 16
+
+typedef struct {
+	uint64_t edid;     /* profile_edid_hash() of the output's EDID */
+	int32_t x, y;
+	uint16_t w, h;
+	uint32_t refresh;  /* mHz */
+	uint8_t disabled;
+	uint8_t primary;
+	uint8_t pad[6];
+} ProfileOutput;
+
+/* Layout of one set of connected monitors, fixed size record of the database */
+typedef struct {
+	uint64_t key;      /* hash over the sorted output EDID hashes */
+	uint32_t noutput;
+	uint32_t pad;
+	ProfileOutput outputs[PROFILE_MAX_OUTPUTS]; /* sorted by edid */
+} Profile;
+
+/* On disk: header, nprofile index entries sorted by key, nprofile records.
+ * Everything is stored in host byte order, byteorder tells readers apart. */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t record_size;
+	uint32_t nprofile;
+} ProfileHeader;
+
+typedef struct {
+	uint64_t key;
+	uint32_t record;
+	uint32_t pad;
+} ProfileIndex;
+
+typedef struct {
+	void *map;
+	size_t size;
+	const ProfileHeader *hdr;
+	const ProfileIndex *index;
+	const Profile *records;
+} ProfileDB;
+
+/* Database */
+int profiledb_open(ProfileDB *db, const char *path);
+void profiledb_close(ProfileDB *db);
+const Profile *profiledb_find(const ProfileDB *db, const Profile *key);
+int profiledb_store(const char *path, const Profile *p);
+const char *profiledb_path(void);
+
+/* Profiles */
+uint64_t profile_edid_hash(const unsigned char *edid, int len);
+void profile_finish(Profile *p);
+const ProfileOutput *profile_output(const Profile *p, uint64_t edid);
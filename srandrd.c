@@ -1,61 +1,273 @@
 /* See LICENSE for copyright and license details
  * srandrd - simple randr daemon
  */
+#include <dlfcn.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/netlink.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xrandr.h>
 #include <X11/extensions/Xinerama.h>
 
+#include "edid.h"
+#include "gamma.h"
+#include "icc.h"
+#include "srandrd.h"
+
 #define OCNE(X) ((XRROutputChangeNotifyEvent*)X)
 #define EVENT_SIZE 128
 #define EDID_SIZE 17
 #define SCREENID_SIZE 3
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
+#define LENGTH(X) (sizeof(X) / sizeof(X[0]))
+#define OUTPUT_SIZE 64
+#define CONNECTIONS_SIZE 256 /* power of two, well above the outputs of any server */
+#define MAX_JOBS 4
+#define MAX_PLUGINS 8
+#define MAX_CLIENTS 32
+#define CLIENT_BUF_SIZE 32768 /* a subscriber that falls this far behind is dropped, holds a full batch */
+#define MAX_PENDING 64
+#define MAX_DISPLAYS 64
+#define POWER_SUPPLY "/sys/class/power_supply"
+#define MAX_SCHEDULE 16
+#define FADE_STEP_MS 16
+#define NEUTRAL_KELVIN 6500
+#define STATS_SIZE 256 /* latency samples kept, older ones are overwritten */
+
+extern char **environ;
 
 typedef struct OutputConnection OutputConnection;
+typedef struct Job Job;
+
+/* Monitors and the Xinerama screen each of them is shown on */
+typedef struct
+{
+	XRRMonitorInfo *mi;
+	int nmonitors;
+	int *msid;
+	int nscreens;
+} Snapshot;
 
+/* Slot of the connection table, output is None while the slot is free */
 struct OutputConnection
 {
 	RROutput output;
 	int sid;
-	char *edid;
 	int edidlen;
-	OutputConnection *next;
+	char edid[EDID_SIZE];
+	char name[EDID_TEXT_SIZE];  /* monitor name, empty if unknown */
+	unsigned short *vcgt;       /* calibration ramps of vcgtsize entries each */
+	int vcgtsize;               /* zero until looked up, vcgt is NULL without one */
+};
+
+/* What handlers and subscribers learn about an output change */
+typedef struct
+{
+	char output[OUTPUT_SIZE];
+	char *event;                /* one of CON_EVENTS */
+	char edid[EDID_SIZE];
+	char name[EDID_TEXT_SIZE];
+	int sid;
+	int x, y;
+	unsigned int width, height; /* zero without crtc */
+	Time timestamp;
+	unsigned long batch;        /* events of one batch share this */
+	int batchsize;
+	unsigned long sample;       /* latency sample, zero without one */
+	const char *display;        /* name of the display of the output */
+} Event;
+
+/* An output changed in the open batch */
+typedef struct
+{
+	RROutput output;
+	Window root;                /* of the screen the output belongs to */
+	uint64_t dequeued;          /* when its first change was read */
+} Change;
+
+/* Color temperature from minute of the day on */
+typedef struct
+{
+	int minute;
+	int kelvin;
+} TempPoint;
+
+/* What sending ramps to a crtc needs, so fade steps cost no round trips */
+typedef struct
+{
+	RRCrtc crtc;
+	RROutput output;            /* first output, None without or without -c */
+	int size;                   /* gamma size, 0 without gamma */
+} CrtcRamp;
+
+/* A watched display with the outputs it knows of and its open batch */
+typedef struct
+{
+	Display *dpy;
+	const char *name;
+	int rrevent;
+	OutputConnection connections[CONNECTIONS_SIZE];
+	int nconnections;
+	Change pending[MAX_PENDING];  /* outputs changed since the batch was opened */
+	int npending;
+	struct timespec deadline;     /* when the open batch is handled */
+	CrtcRamp *crtcs;              /* of every screen, NULL until needed and after a batch */
+	int ncrtcs;
+} XDisplay;
+
+/* Way of one output change to its handler, microseconds of CLOCK_MONOTONIC */
+typedef struct
+{
+	unsigned long seq;          /* zero while the slot is unused */
+	Time server;                /* output info timestamp, server milliseconds */
+	uint64_t dequeued, fetched, spawned, exited;
+} Sample;
+
+/* A handler run for a batch, queued until it may start */
+struct Job
+{
+	Event ev;                   /* output the job handles, the first one with all */
+	char *cmd;                  /* shell command of a rule, NULL runs the command line */
+	char *changes;              /* every output of the batch, for SRANDRD_CHANGES */
+	int all;                    /* handles every output of its batch at once */
+	unsigned long sample;       /* first latency sample it handles, zero without */
+	int nsamples;
+	pid_t pid;
+	Job *next;
 };
 
+/* Line of the rules file, fields left empty match anything */
+typedef struct
+{
+	char output[OUTPUT_SIZE];
+	int glob;                   /* output contains wildcards and needs fnmatch */
+	char edid[EDID_SIZE];
+	int sid;                    /* -1 matches any screen */
+	char *cmd;
+} Rule;
+
+/* Event stream subscriber, fd is -1 while the slot is free */
+typedef struct
+{
+	int fd;
+	size_t len;
+	char buf[CLIENT_BUF_SIZE];
+} Client;
+
 char *CON_EVENTS[] = { "connected", "disconnected", "unknown" };
 
-OutputConnection *CONNECTIONS = 0;
+XDisplay *DISPLAYS = 0;
+int NDISPLAYS = 0;
+
+Job *JOBS = 0;
+int RUNNING = 0;
+int MAXJOBS = MAX_JOBS;
+int CHILDPIPE[2] = { -1, -1 };
+volatile sig_atomic_t RELOAD = 0;
+
+/* Rules by the index of their event in CON_EVENTS, in file order */
+char *RULESPATH = 0;
+Rule *RULES = 0;
+int NRULES = 0;
+Rule **BYEVENT[LENGTH(CON_EVENTS)];
+int NBYEVENT[LENGTH(CON_EVENTS)];
+int EPFD = -1;
+
+char *SOCKPATH = 0;
+int SOCKFD = -1;
+Client CLIENTS[MAX_CLIENTS];
+
+unsigned long BATCH = 0;
+int WINDOW = 0;
+int ONCE = 0;                   /* command line runs once per batch */
+
+/* Final state of the outputs of the batch being emitted */
+Event CHANGES[MAX_PENDING];
+int NCHANGES = 0;
+int PROBE = 0;
+
+/* Refresh policy, ONAC is -1 until the power state was first read */
+int POLICY = 0;
+int ONAC = -1;
+int INOTIFYFD = -1;
+int UEVENTFD = -1;
+
+/* Color temperature schedule, the timer fires every FADE_STEP_MS while
+ * fading and once at the next schedule point otherwise */
+TempPoint SCHEDULE[MAX_SCHEDULE];
+int NSCHEDULE = 0;
+int FADE = 60;
+int TIMERFD = -1;
+int FADING = 0;
+double KELVIN = NEUTRAL_KELVIN, FADEFROM, FADETO;
+uint64_t FADESTART;
+unsigned short WHITE[3];        /* white point of the ramps last sent */
+int WHITESET = 0;
+
+/* ICC profiles named after the EDID of the output they calibrate */
+const char *ICCDIR = NULL;
+
+Sample STATS[STATS_SIZE];
+unsigned long NSAMPLES = 0;
+
+SrandrdPlugin PLUGINS[MAX_PLUGINS];
+int NPLUGINS = 0;
 
 char **ARGV;
 int ARGS;
 
-OutputConnection *cache_connection(OutputConnection * head, RROutput output, char *edid, int edidlen, int sid);
 static void xerror(const char *format, ...);
 static int error_handler(void);
 static void catch_child(int sig);
+static void catch_hup(int sig);
 static void help(int status);
 static void version(void);
-int get_screenid(Display * dpy, RROutput output);
-int get_edid(Display * dpy, RROutput out, char *edid, int edidlen);
-int iter_crtcs(Display * dpy, void (*f) (Display *, char *, char *, int));
-void print_crtc(Display * dpy, char *name, char *edid, int sid);
-pid_t emit(Display * dpy, char *output, char *event, char *edid, char *screenid);
-void emit_crtc(Display * dpy, char *name, char *edid, int sid);
-void free_output_connection(OutputConnection * ocon);
-OutputConnection * get_output_connection(OutputConnection * ocon, RROutput output);
-OutputConnection * remove_output_connection(OutputConnection * ocon, RROutput output);
-OutputConnection * add_output_connection(OutputConnection * head, OutputConnection * ocon);
+static void reply_stats(Client * c);
+int load_rules(const char *path);
+int take_snapshot(Display * dpy, Window root, Snapshot * snap);
+void free_snapshot(Snapshot * snap);
+int get_sid(Snapshot * snap, RROutput output);
+int get_edid(Display * dpy, RROutput out, char *edid, int edidlen, char *name);
+int iter_crtcs(XDisplay * d, void (*f) (Display *, Event *));
+void print_crtc(Display * dpy, Event * ev);
+void emit(Display * dpy, Event * ev);
+void emit_batch(void);
+void load_plugin(const char *path);
+int open_socket(const char *path);
+void accept_clients(void);
+void flush_client(Client * c);
+void publish(Event * evs, int n);
+void start_jobs(void);
+void reap_jobs(void);
+void wait_jobs(void);
+void emit_crtc(Display * dpy, Event * ev);
+OutputConnection * get_output_connection(XDisplay * d, RROutput output);
+void remove_output_connection(XDisplay * d, RROutput output);
 void die_if_null(void *ptr);
-OutputConnection * cache_connection(OutputConnection * head, RROutput output, char *edid, int edidlen, int sid);
-int process_events(Display * dpy, int verbose);
+OutputConnection * cache_connection(XDisplay * d, RROutput output, char *edid, int edidlen, const char *name, int sid);
+void open_display(const char *name);
+int open_power_watch(void);
+int parse_schedule(char *s);
+void apply_policy(int verbose);
+int process_events(int verbose);
 int main(int argc, char **argv);
 
 void
@@ -86,24 +298,69 @@ error_handler(void)
 static void
 catch_child(int sig)
 {
+	int e = errno;
+	(void) sig;
+	/* reaped by the event loop */
+	if (write(CHILDPIPE[1], "", 1) < 0) {
+		;
+	}
+	errno = e;
+}
+
+static void
+catch_hup(int sig)
+{
+	int e = errno;
 	(void) sig;
-	while (waitpid(-1, NULL, WNOHANG) > 0) {
+	RELOAD = 1;
+	if (write(CHILDPIPE[1], "", 1) < 0) {
 		;
 	}
+	errno = e;
 }
 
 static void
 help(int status)
 {
-	fprintf(stderr, "Usage: " NAME " [option] command|list\n\n"
-			"   list  List outputs and EDIDs and terminate\n\n"
+	fprintf(stderr, "Usage: " NAME " [option] [command|list]\n\n"
+			"   list  List outputs and EDIDs and terminate\n"
+			"   stats Print handler latencies of the daemon listening on -s\n\n"
 			"Options:\n"
 			"   -h  Print this help and exit\n"
 			"   -n  Don't fork to background\n"
 			"   -V  Print version information and exit\n"
 			"   -v  Verbose output\n"
 			"   -e  Emit connected devices at startup\n"
-			"   -1  One-shot mode (emit devices and exit)\n");
+			"   -1  One-shot mode (emit devices and exit)\n"
+			"   -j  Maximum number of handlers running at once (default %d)\n"
+			"   -s  Stream events as JSON lines to subscribers of this socket,\n"
+			"       the command is optional then\n"
+			"   -p  Load a plugin and call it for every event, may be repeated,\n"
+			"       the command is optional then\n"
+			"   -d  Collect changes for this many milliseconds into one batch\n"
+			"       (default 0, only changes already queued are batched)\n"
+			"   -B  Run the command once per batch instead of once per changed\n"
+			"       output, the SRANDRD_* variables describe the first one\n"
+			"   -D  Watch this display, may be repeated (default $DISPLAY)\n"
+			"   -P  Probe outputs for every batch instead of using the state\n"
+			"       known to the server\n"
+			"   -b  Switch outputs to the lowest refresh rate of their\n"
+			"       resolution on battery and to the highest on AC, the\n"
+			"       command is optional then\n"
+			"   -t  Follow a color temperature schedule HH:MM=KELVIN[,...],\n"
+			"       the command is optional then\n"
+			"   -T  Seconds a color temperature change takes (default 60)\n"
+			"   -c  Calibrate outputs with the vcgt curves of DIR/EDID.icc,\n"
+			"       the command is optional then\n"
+			"   -r  Run the commands of matching rules from this file, the\n"
+			"       command is optional then. SIGHUP reloads the file\n"
+			"\n"
+			"Handlers run in the background. Events of one output are handled\n"
+			"in order, events of different outputs in parallel. A batch emits\n"
+			"one event per changed output with its final state, subscribers get\n"
+			"the batch as one line. SRANDRD_CHANGES has a line \"output event\n"
+			"edid screenid name\" for every output of the batch, - for an unknown\n"
+			"edid or screenid.\n", MAX_JOBS);
 	exit(status);
 }
 
@@ -116,341 +373,1859 @@ version(void)
 	exit(EXIT_SUCCESS);
 }
 
+static void
+free_rules(Rule * rules, int nrules, Rule ** byevent[])
+{
+	int i;
+	for (i = 0; i < nrules; i++) {
+		free(rules[i].cmd);
+	}
+	free(rules);
+	for (i = 0; i < (int) LENGTH(CON_EVENTS); i++) {
+		free(byevent[i]);
+	}
+}
+
+/* Parses one rule, "output edid event screenid command...", with * for any */
+static int
+parse_rule(char *line, Rule * rule, int *event)
+{
+	char output[OUTPUT_SIZE], edid[EDID_SIZE], ev[16], sid[8], *end;
+	int n = 0, i;
+
+	if (sscanf(line, "%63s %16s %15s %7s %n", output, edid, ev, sid, &n) != 4 || !line[n]) {
+		return 0;
+	}
+	memset(rule, 0, sizeof(Rule));
+	if (strcmp(output, "*")) {
+		strcpy(rule->output, output);
+		rule->glob = strpbrk(output, "*?[") != NULL;
+	}
+	if (strcmp(edid, "*")) {
+		strcpy(rule->edid, edid);
+	}
+	*event = -1;
+	if (strcmp(ev, "*")) {
+		for (i = 0; i < (int) LENGTH(CON_EVENTS) && strcmp(ev, CON_EVENTS[i]); i++);
+		if (i == LENGTH(CON_EVENTS)) {
+			return 0;
+		}
+		*event = i;
+	}
+	rule->sid = -1;
+	if (strcmp(sid, "*")) {
+		rule->sid = strtol(sid, &end, 10);
+		if (*end || rule->sid < 0) {
+			return 0;
+		}
+	}
+	line[strcspn(line, "\n")] = 0;
+	rule->cmd = strdup(line + n);
+	die_if_null(rule->cmd);
+	return 1;
+}
+
+/* Compiles the rules file into per event tables, keeps the current rules on errors */
 int
-get_sid(Display * dpy, RROutput output)
+load_rules(const char *path)
 {
-	XRRMonitorInfo *mi;
-	XRRScreenResources *sr;
-	XineramaScreenInfo *si;
-	int i, j, k, sid = -1;
-	int nmonitors, nscreens;
+	Rule *rules = NULL, **byevent[LENGTH(CON_EVENTS)] = { 0 };
+	int nbyevent[LENGTH(CON_EVENTS)] = { 0 };
+	int *events = NULL, nrules = 0, size = 0, lineno = 0, i, j;
+	char line[1024], *p;
+	FILE *f;
 
-	si = XineramaQueryScreens(dpy, &nscreens);
-	mi = XRRGetMonitors(dpy, DefaultRootWindow(dpy), True, &nmonitors);
-	sr = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
+	if (!(f = fopen(path, "r"))) {
+		fprintf(stderr, "Could not open rules %s\n", path);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++);
+		if (*p == '#' || *p == '\n' || !*p) {
+			continue;
+		}
+		if (nrules == size) {
+			size = size ? size * 2 : 16;
+			rules = realloc(rules, size * sizeof(Rule));
+			events = realloc(events, size * sizeof(int));
+			die_if_null(rules);
+			die_if_null(events);
+		}
+		if (!parse_rule(p, &rules[nrules], &events[nrules])) {
+			fprintf(stderr, "%s:%d: invalid rule\n", path, lineno);
+			fclose(f);
+			free(events);
+			free_rules(rules, nrules, byevent);
+			return 0;
+		}
+		nrules++;
+	}
+	fclose(f);
 
-	for (j = 0; j < nmonitors; ++j) {
-		for (k = 0; k < mi[j].noutput && mi[j].outputs[k] != output; ++k) {
-			;
+	for (j = 0; j < (int) LENGTH(CON_EVENTS); j++) {
+		byevent[j] = malloc(sizeof(Rule *) * (nrules ? nrules : 1));
+		die_if_null(byevent[j]);
+		for (i = 0; i < nrules; i++) {
+			if (events[i] == -1 || events[i] == j) {
+				byevent[j][nbyevent[j]++] = &rules[i];
+			}
 		}
-		if (k < mi[j].noutput) {
-			break;
+	}
+	free(events);
+
+	free_rules(RULES, NRULES, BYEVENT);
+	RULES = rules;
+	NRULES = nrules;
+	memcpy(BYEVENT, byevent, sizeof(byevent));
+	memcpy(NBYEVENT, nbyevent, sizeof(nbyevent));
+	return 1;
+}
+
+static int
+match_rule(Rule * rule, Event * ev)
+{
+	if (rule->sid != -1 && rule->sid != ev->sid) {
+		return 0;
+	}
+	if (rule->edid[0] && strcmp(rule->edid, ev->edid)) {
+		return 0;
+	}
+	if (rule->output[0]) {
+		return rule->glob ? fnmatch(rule->output, ev->output, 0) == 0 : strcmp(rule->output, ev->output) == 0;
+	}
+	return 1;
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The sample numbered seq, or NULL once it was overwritten */
+static Sample *
+get_sample(unsigned long seq)
+{
+	Sample *s = &STATS[seq % STATS_SIZE];
+	return seq && s->seq == seq ? s : NULL;
+}
+
+static Sample *
+new_sample(void)
+{
+	Sample *s = &STATS[++NSAMPLES % STATS_SIZE];
+	memset(s, 0, sizeof(Sample));
+	s->seq = NSAMPLES;
+	return s;
+}
+
+/* Takes one snapshot of the Xinerama screens and RandR monitors and maps
+ * every monitor to its screen, so screen ids cost no further round-trips */
+int
+take_snapshot(Display * dpy, Window root, Snapshot * snap)
+{
+	XineramaScreenInfo *si;
+	int i, j, nscreens = 0;
+
+	memset(snap, 0, sizeof(Snapshot));
+	si = XineramaQueryScreens(dpy, &nscreens);
+	snap->mi = XRRGetMonitors(dpy, root, True, &snap->nmonitors);
+	if (!si || !snap->mi) {
+		if (si) {
+			XFree(si);
 		}
+		free_snapshot(snap);
+		return 0;
 	}
 
-	if (si && mi && j < nmonitors) {
+	snap->nscreens = nscreens;
+	snap->msid = malloc(sizeof(int) * (snap->nmonitors ? snap->nmonitors : 1));
+	die_if_null(snap->msid);
+	for (j = 0; j < snap->nmonitors; ++j) {
+		snap->msid[j] = -1;
 		for (i = 0; i < nscreens; ++i) {
-			if (si[i].x_org == mi[j].x &&
-				si[i].y_org == mi[j].y && si[i].width == mi[j].width && si[i].height == mi[j].height) {
-				sid = i;
+			if (si[i].x_org == snap->mi[j].x && si[i].y_org == snap->mi[j].y
+				&& si[i].width == snap->mi[j].width && si[i].height == snap->mi[j].height) {
+				snap->msid[j] = i;
 				break;
 			}
 		}
-		XFree(si);
-		XRRFreeMonitors(mi);
 	}
-	XRRFreeScreenResources(sr);
+	XFree(si);
+	return 1;
+}
+
+void
+free_snapshot(Snapshot * snap)
+{
+	if (snap->mi) {
+		XRRFreeMonitors(snap->mi);
+	}
+	free(snap->msid);
+	memset(snap, 0, sizeof(Snapshot));
+}
+
+int
+get_sid(Snapshot * snap, RROutput output)
+{
+	int j, k;
 
-	return sid;
+	for (j = 0; j < snap->nmonitors; ++j) {
+		for (k = 0; k < snap->mi[j].noutput; ++k) {
+			if (snap->mi[j].outputs[k] == output) {
+				return snap->msid[j];
+			}
+		}
+	}
+	return -1;
 }
 
+/* Identity of the monitor on out as vendor, product and serial in hex and
+ * its name, if name is not NULL. Returns 0 without an EDID. */
 int
-get_edid(Display * dpy, RROutput out, char *edid, int edidlen)
-{
-	int props = 0, len = 0;
-	Atom *properties;
-	Atom atom_edid, real;
-	int i, format;
-	uint16_t vendor, product;
-	uint32_t serial;
+get_edid(Display * dpy, RROutput out, char *edid, int edidlen, char *name)
+{
 	unsigned char *p;
-	unsigned long n, extra;
-	Bool has_edid_prop = False;
+	Edid info;
+	int len = 0, n;
 
+	if (name) {
+		name[0] = 0;
+	}
 	if (edidlen) {
 		edid[0] = 0;
 	}
 	else {
 		return len;
 	}
-	properties = XRRListOutputProperties(dpy, out, &props);
-	atom_edid = XInternAtom(dpy, RR_PROPERTY_RANDR_EDID, False);
-	for (i = 0; i < props; i++) {
-		if (properties[i] == atom_edid) {
-			has_edid_prop = True;
-			break;
-		}
-	}
-	XFree(properties);
-
-	if (has_edid_prop) {
-		if (XRRGetOutputProperty(dpy, out, atom_edid, 0L, 128L, False, False,
-								 AnyPropertyType, &real, &format, &n, &extra, &p) == Success) {
-			if (n >= 127) {
-				vendor = (p[9] << 8) | p[8];
-				product = (p[11] << 8) | p[10];
-				serial = p[15] << 24 | p[14] << 16 | p[13] << 8 | p[12];
-				snprintf(edid, edidlen, "%04X%04X%08X", vendor, product, serial);
-				len = EDID_SIZE;
+	if ((p = edid_get(dpy, out, &n))) {
+		if (edid_parse(p, n, &info)) {
+			/* the vendor bytes are swapped like srandrd always printed them,
+			 * rules and profiles name monitors by this string */
+			snprintf(edid, edidlen, "%04X%04X%08X", (info.vendor & 0xff) << 8 | info.vendor >> 8,
+					 info.product, info.serial);
+			if (name) {
+				memcpy(name, info.name, EDID_TEXT_SIZE);
 			}
-			free(p);
+			len = EDID_SIZE;
 		}
+		XFree(p);
 	}
 	return len;
 }
 
+static void
+fill_event(Display * dpy, XRRScreenResources * sr, XRROutputInfo * info, Event * ev)
+{
+	XRRCrtcInfo *crtc;
+
+	snprintf(ev->output, OUTPUT_SIZE, "%s", info->name);
+	ev->event = CON_EVENTS[info->connection];
+	ev->timestamp = info->timestamp;
+	if (info->crtc && (crtc = XRRGetCrtcInfo(dpy, sr, info->crtc))) {
+		ev->x = crtc->x;
+		ev->y = crtc->y;
+		ev->width = crtc->width;
+		ev->height = crtc->height;
+		XRRFreeCrtcInfo(crtc);
+	}
+}
+
+/* Calls f for the outputs of every monitor on every screen of the display */
 int
-iter_crtcs(Display * dpy, void (*f) (Display *, char *, char *, int))
+iter_crtcs(XDisplay * d, void (*f) (Display *, Event *))
 {
+	Snapshot snap;
 	XRRMonitorInfo *mi;
 	XRRScreenResources *sr;
-	XineramaScreenInfo *si;
 	XRROutputInfo *info;
-	char edid[EDID_SIZE];
-	int i, j, k, edidlen, nmonitors, nscreens, sid = -1;
+	Display *dpy = d->dpy;
+	Event ev;
+	int i, j, k, s, edidlen;
 
-	si = XineramaQueryScreens(dpy, &nscreens);
-	mi = XRRGetMonitors(dpy, DefaultRootWindow(dpy), True, &nmonitors);
-	sr = XRRGetScreenResourcesCurrent(dpy, DefaultRootWindow(dpy));
-	if (si && mi) {
-		for (i = 0; i < nscreens; ++i) {
-			for (j = 0; j < nmonitors; ++j) {
-				for (k = 0; k < mi[j].noutput; ++k) {
-					sid = get_sid(dpy, mi[j].outputs[k]);
-					if (i != sid) {
-						continue;
-					}
-					info = XRRGetOutputInfo(dpy, sr, mi[j].outputs[k]);
-					edidlen = get_edid(dpy, mi[j].outputs[k], edid, EDID_SIZE);
-					CONNECTIONS = cache_connection(CONNECTIONS, mi[j].outputs[k], edid, edidlen, sid);
-					f(dpy, info->name, edid, sid);
-					XRRFreeOutputInfo(info);
-				}
-				if (i == sid) {
-					break;
+	for (s = 0; s < ScreenCount(dpy); s++) {
+		if (!take_snapshot(dpy, RootWindow(dpy, s), &snap)) {
+			continue;
+		}
+		sr = XRRGetScreenResourcesCurrent(dpy, RootWindow(dpy, s));
+		for (i = 0; sr && i < snap.nscreens; ++i) {
+			/* first monitor of each screen */
+			for (j = 0; j < snap.nmonitors && snap.msid[j] != i; ++j);
+			if (j == snap.nmonitors) {
+				continue;
+			}
+			mi = &snap.mi[j];
+			for (k = 0; k < mi->noutput; ++k) {
+				info = XRRGetOutputInfo(dpy, sr, mi->outputs[k]);
+				if (!info) {
+					continue;
 				}
+				memset(&ev, 0, sizeof(Event));
+				fill_event(dpy, sr, info, &ev);
+				/* emitted as connected regardless of the connection state */
+				ev.event = CON_EVENTS[0];
+				ev.sid = i;
+				ev.display = d->name;
+				edidlen = get_edid(dpy, mi->outputs[k], ev.edid, EDID_SIZE, ev.name);
+				cache_connection(d, mi->outputs[k], ev.edid, edidlen, ev.name, i);
+				f(dpy, &ev);
+				XRRFreeOutputInfo(info);
 			}
 		}
-		XFree(si);
-		XRRFreeMonitors(mi);
+		if (sr) {
+			XRRFreeScreenResources(sr);
+		}
+		free_snapshot(&snap);
 	}
-	XRRFreeScreenResources(sr);
 	return EXIT_SUCCESS;
 }
 
 void
-print_crtc(Display * dpy, char *name, char *edid, int sid)
+print_crtc(Display * dpy, Event * ev)
 {
-	printf("%s %s\n", name, edid);
+	printf("%s %s\n", ev->output, ev->edid);
 }
 
-pid_t
-emit(Display * dpy, char *output, char *event, char *edid, char *screenid)
+static pid_t
+spawn_job(Job * job)
 {
+	posix_spawnattr_t attr;
+	char screenid[SCREENID_SIZE], batch[24];
+	char *argv[] = { "sh", "-c", NULL, NULL };
 	pid_t pid;
-	if ((pid = fork()) == 0) {
-		if (dpy) {
-			close(ConnectionNumber(dpy));
+
+	screenid[0] = 0;
+	if (job->ev.sid != -1) {
+		snprintf(screenid, SCREENID_SIZE, "%d", job->ev.sid);
+	}
+	if (job->ev.display) {
+		setenv("DISPLAY", job->ev.display, True);
+	}
+	setenv("SRANDRD_OUTPUT", job->ev.output, True);
+	setenv("SRANDRD_EVENT", job->ev.event, True);
+	setenv("SRANDRD_EDID", job->ev.edid, True);
+	setenv("SRANDRD_NAME", job->ev.name, True);
+	setenv("SRANDRD_SCREENID", screenid, True);
+	snprintf(batch, sizeof(batch), "%lu", job->ev.batch);
+	setenv("SRANDRD_BATCH", batch, True);
+	snprintf(batch, sizeof(batch), "%d", job->ev.batchsize);
+	setenv("SRANDRD_BATCHSIZE", batch, True);
+	setenv("SRANDRD_CHANGES", job->changes, True);
+
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#endif
+	if (job->cmd) {
+		argv[2] = job->cmd;
+		if (posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ) != 0) {
+			pid = -1;
 		}
-		setsid();
-		setenv("SRANDRD_OUTPUT", output, True);
-		setenv("SRANDRD_EVENT", event, True);
-		setenv("SRANDRD_EDID", edid, True);
-		setenv("SRANDRD_SCREENID", screenid, True);
-		execvp(ARGV[ARGS], &(ARGV[ARGS]));
 	}
-	return waitpid(pid, NULL, 0);
+	else if (posix_spawnp(&pid, ARGV[ARGS], NULL, &attr, &(ARGV[ARGS]), environ) != 0) {
+		pid = -1;
+	}
+	posix_spawnattr_destroy(&attr);
+	return pid;
 }
 
-void
-emit_crtc(Display * dpy, char *name, char *edid, int sid)
+static void
+remove_job(Job * job)
 {
-	char screenid[SCREENID_SIZE];
-	screenid[0] = 0;
-	if (sid != -1) {
-		snprintf(screenid, SCREENID_SIZE, "%d", sid);
+	Job **j;
+	for (j = &JOBS; *j && *j != job; j = &(*j)->next);
+	if (*j) {
+		*j = job->next;
+		free(job->cmd);
+		free(job->changes);
+		free(job);
+	}
+}
+
+/* Whether b has to wait for a, a job for the whole batch waits for and
+ * holds up every job of its display */
+static int
+same_output(Job * a, Job * b)
+{
+	return a->ev.display == b->ev.display && (a->all || b->all || strcmp(a->ev.output, b->ev.output) == 0);
+}
+
+/* Stamps the latency samples of the outputs the job handles */
+static void
+stamp_samples(Job * job, int exited)
+{
+	Sample *sample;
+	uint64_t now = now_us();
+	int i;
+
+	for (i = 0; job->sample && i < job->nsamples; i++) {
+		if ((sample = get_sample(job->sample + i))) {
+			*(exited ? &sample->exited : &sample->spawned) = now;
+		}
 	}
-	emit(dpy, name, CON_EVENTS[0], edid, screenid);
 }
 
+/* Starts queued jobs while below the limit, a job waits for all earlier jobs of its output */
 void
-free_output_connection(OutputConnection * ocon)
+start_jobs(void)
 {
-	if (ocon) {
-		free(ocon->edid);
-		free(ocon);
+	Job *job, *next, *prev;
+
+	for (job = JOBS; job && RUNNING < MAXJOBS; job = next) {
+		next = job->next;
+		if (job->pid) {
+			continue;
+		}
+		for (prev = JOBS; prev != job && !same_output(prev, job); prev = prev->next);
+		if (prev != job) {
+			continue;
+		}
+		if ((job->pid = spawn_job(job)) < 0) {
+			fprintf(stderr, "Could not run handler for %s\n", job->ev.output);
+			remove_job(job);
+			continue;
+		}
+		stamp_samples(job, 0);
+		RUNNING++;
 	}
 }
 
-OutputConnection *
-get_output_connection(OutputConnection * ocon, RROutput output)
+static void
+job_done(pid_t pid)
 {
-	OutputConnection *_ocon = ocon;
-	for (; _ocon && _ocon->output != output; _ocon = _ocon->next);
-	return _ocon;
+	Job *job;
+	for (job = JOBS; job && job->pid != pid; job = job->next);
+	if (job) {
+		stamp_samples(job, 1);
+		remove_job(job);
+		RUNNING--;
+	}
 }
 
-OutputConnection *
-remove_output_connection(OutputConnection * ocon, RROutput output)
+void
+reap_jobs(void)
 {
-	OutputConnection *_ocon = ocon;
-	if (_ocon && _ocon->output == output) {
-		OutputConnection *next = _ocon->next;
-		free_output_connection(_ocon);
-		return next;
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+		job_done(pid);
 	}
-	for (; _ocon && _ocon->next && _ocon->next->output != output; _ocon = _ocon->next);
-	if (_ocon && _ocon->next && _ocon->next->output == output) {
-		OutputConnection *old_ocon = _ocon->next;
-		_ocon->next = _ocon->next->next;
-		free_output_connection(old_ocon);
+	start_jobs();
+}
+
+/* Blocks until every queued job has run */
+void
+wait_jobs(void)
+{
+	pid_t pid;
+	start_jobs();
+	while (JOBS) {
+		if ((pid = waitpid(-1, NULL, 0)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		job_done(pid);
+		start_jobs();
 	}
-	return ocon;
 }
 
-OutputConnection *
-add_output_connection(OutputConnection * head, OutputConnection * ocon)
+void
+load_plugin(const char *path)
 {
-	OutputConnection *_ocon = head;
-	if (!ocon) {
-		return head;
+	void *handle;
+
+	if (NPLUGINS == MAX_PLUGINS) {
+		xerror("Too many plugins\n");
+	}
+	if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		xerror("Could not load plugin %s: %s\n", path, dlerror());
 	}
-	if (!head) {
-		return ocon;
+	/* the function pointer round trip through void * is what POSIX guarantees for dlsym */
+	*(void **) (&PLUGINS[NPLUGINS]) = dlsym(handle, SRANDRD_PLUGIN_SYMBOL);
+	if (!PLUGINS[NPLUGINS]) {
+		xerror("Plugin %s does not export " SRANDRD_PLUGIN_SYMBOL "\n", path);
 	}
-	for (; _ocon && _ocon->next; _ocon = _ocon->next);
-	_ocon->next = ocon;
-	return head;
+	NPLUGINS++;
 }
 
-OutputConnection *
-cache_connection(OutputConnection * head, RROutput output, char *edid, int edidlen, int sid)
+/* Queues cmd for ev, or with all for every output of the batch */
+static void
+queue_job(Event * ev, const char *cmd, const char *changes, int all)
 {
-	OutputConnection *ocon = malloc(sizeof(OutputConnection));
-	die_if_null(ocon);
-	memset(ocon, 0, sizeof(OutputConnection));
-	ocon->output = output;
+	Job *job, **last;
 
-	ocon->edid = malloc(sizeof(char) * EDID_SIZE);
-	memset(ocon->edid, 0, EDID_SIZE);
-	die_if_null(ocon->edid);
+	job = malloc(sizeof(Job));
+	die_if_null(job);
+	memset(job, 0, sizeof(Job));
+	job->ev = *ev;
+	job->all = all;
+	job->sample = ev->sample;
+	job->nsamples = 1;
+	if (all) {
+		/* the samples of a batch are taken one after another */
+		job->nsamples = NCHANGES;
+	}
+	if (cmd) {
+		job->cmd = strdup(cmd);
+		die_if_null(job->cmd);
+	}
+	job->changes = strdup(changes);
+	die_if_null(job->changes);
 
-	ocon->edidlen = edidlen;
-	strncpy(ocon->edid, edid, edidlen);
+	for (last = &JOBS; *last; last = &(*last)->next);
+	*last = job;
+}
 
-	ocon->sid = sid;
+/* Plugins see every output as it is handled, everything else waits for the
+ * end of the batch */
+void
+emit(Display * dpy, Event * ev)
+{
+	int i;
 
-	return add_output_connection(head, ocon);
+	for (i = 0; i < NPLUGINS; i++) {
+		PLUGINS[i] (dpy, ev->output, ev->event, ev->edid, ev->sid);
+	}
+	if (NCHANGES == MAX_PENDING) {
+		emit_batch();
+	}
+	CHANGES[NCHANGES++] = *ev;
 }
 
-int
-process_events(Display * dpy, int verbose)
+/* Publishes the batch as one event and queues the matching commands of
+ * every output, the final state of an output replaces earlier ones */
+void
+emit_batch(void)
 {
-	XRRScreenResources *sr;
-	XRROutputInfo *info;
-	XEvent ev;
-	char edid[EDID_SIZE], screenid[SCREENID_SIZE];
-	int i, edidlen;
+	static char changes[MAX_PENDING * (OUTPUT_SIZE + EDID_SIZE + EDID_TEXT_SIZE + 32)];
+	Event *ev;
+	size_t len = 0;
+	int i, j, e;
 
-	XRRSelectInput(dpy, DefaultRootWindow(dpy), RROutputChangeNotifyMask);
-	XSync(dpy, False);
-	XSetIOErrorHandler((XIOErrorHandler) error_handler);
-	while (1) {
-		if (!XNextEvent(dpy, &ev)) {
-			i = -1;
-			edidlen = 0;
-			memset(edid, 0, EDID_SIZE);
-			memset(screenid, 0, SCREENID_SIZE);
-
-			sr = XRRGetScreenResources(OCNE(&ev)->display, OCNE(&ev)->window);
-			if (sr == NULL) {
-				fprintf(stderr, "Could not get screen resources\n");
-				continue;
-			}
+	if (!NCHANGES) {
+		return;
+	}
+	for (i = 0; i < NCHANGES; i++) {
+		ev = &CHANGES[i];
+		ev->batchsize = NCHANGES;
+		len += snprintf(changes + len, sizeof(changes) - len, "%s %s %s ", ev->output, ev->event,
+						ev->edid[0] ? ev->edid : "-");
+		len += ev->sid != -1 ? snprintf(changes + len, sizeof(changes) - len, "%d", ev->sid)
+			: snprintf(changes + len, sizeof(changes) - len, "-");
+		len += snprintf(changes + len, sizeof(changes) - len, " %s\n", ev->name);
+	}
+	publish(CHANGES, NCHANGES);
 
-			info = XRRGetOutputInfo(OCNE(&ev)->display, sr, OCNE(&ev)->output);
-			if (info == NULL) {
-				XRRFreeScreenResources(sr);
-				fprintf(stderr, "Could not get output info\n");
-				continue;
+	if (ONCE && ARGV[ARGS]) {
+		queue_job(&CHANGES[0], NULL, changes, 1);
+	}
+	for (i = 0; i < NCHANGES; i++) {
+		ev = &CHANGES[i];
+		for (j = i + 1; j < NCHANGES && (ev->display != CHANGES[j].display || strcmp(ev->output, CHANGES[j].output)); j++);
+		if (j < NCHANGES) {
+			continue;
+		}
+		/* only commands of matching rules are spawned */
+		for (e = 0; e < (int) LENGTH(CON_EVENTS) && ev->event != CON_EVENTS[e]; e++);
+		for (j = 0; e < (int) LENGTH(CON_EVENTS) && j < NBYEVENT[e]; j++) {
+			if (match_rule(BYEVENT[e][j], ev)) {
+				queue_job(ev, BYEVENT[e][j]->cmd, changes, 0);
 			}
+		}
+		if (!ONCE && ARGV[ARGS]) {
+			queue_job(ev, NULL, changes, 0);
+		}
+	}
+	NCHANGES = 0;
+	start_jobs();
+}
 
-			if (strncmp(CON_EVENTS[info->connection], "disconnected", 12) == 0) {
-				/* retrieve edid and screen information from cache */
-				OutputConnection *ocon = get_output_connection(CONNECTIONS, OCNE(&ev)->output);
-				if (ocon) {
-					i = ocon->sid;
-					edidlen = ocon->edidlen;
-					strncpy(edid, ocon->edid, edidlen);
-					CONNECTIONS = remove_output_connection(CONNECTIONS, OCNE(&ev)->output);
-				}
-			}
-			else {
-				edidlen = get_edid(OCNE(&ev)->display, OCNE(&ev)->output, edid, EDID_SIZE);
-				i = get_sid(OCNE(&ev)->display, OCNE(&ev)->output);
-				CONNECTIONS = cache_connection(CONNECTIONS, OCNE(&ev)->output, edid, edidlen, i);
-			}
-			if (i != -1) {
-				snprintf(screenid, SCREENID_SIZE, "%d", i);
-			}
+void
+emit_crtc(Display * dpy, Event * ev)
+{
+	emit(dpy, ev);
+}
 
-			if (verbose) {
-				printf("Event: %d %s %s\n", ev.type, info->name, CON_EVENTS[info->connection]);
-				printf("Time: %lu\n", info->timestamp);
-				if (info->crtc == 0) {
-					printf("Size: %lumm x %lumm\n", info->mm_width, info->mm_height);
-				}
-				else {
-					printf("CRTC: %lu\n", info->crtc);
-					XRRCrtcInfo *crtc = XRRGetCrtcInfo(dpy, sr, info->crtc);
-					if (crtc != NULL) {
-						printf("Size: %dx%d\n", crtc->width, crtc->height);
-						XRRFreeCrtcInfo(crtc);
-					}
-				}
-				if (edidlen) {
-					printf("EDID (vendor, product, serial): %s\n", edid);
-				}
-				else {
-					printf("EDID (vendor, product, serial): not available\n");
-				}
-			}
-			emit(dpy, info->name, CON_EVENTS[info->connection], edid, screenid);
-			XRRFreeScreenResources(sr);
-			XRRFreeOutputInfo(info);
-		}
+static void
+remove_socket(void)
+{
+	if (SOCKPATH) {
+		unlink(SOCKPATH);
 	}
-	return EXIT_SUCCESS;
+}
+
+/* Removes the socket a crashed daemon left behind, a running daemon still
+ * answers and keeps its socket. Returns 0 if path is in use. */
+static int
+claim_socket(const char *path)
+{
+	struct sockaddr_un sa;
+	struct stat st;
+	int fd, unused;
+
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		return 1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		return 1;
+	}
+	/* anything else but a refused connection is left to bind to report */
+	if ((unused = connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) && errno == ECONNREFUSED
+		&& lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	close(fd);
+	return unused;
 }
 
 int
-main(int argc, char **argv)
+open_socket(const char *path)
 {
-	Display *dpy;
-	int daemonize = 1, args = 1, verbose = 0, emit = 0, list = 0, oneshot = 0;
-	int rv = 0;
-	uid_t uid;
+	struct sockaddr_un sa;
+	int fd, i;
 
-	if (argc < 2) {
-		help(EXIT_FAILURE);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		CLIENTS[i].fd = -1;
 	}
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
 
-	for (args = 1; args < argc && *(argv[args]) == '-'; args++) {
-		switch (argv[args][1]) {
-		case 'V':
-			version();
-		case 'n':
-			daemonize = 0;
-			break;
-		case 'v':
-			verbose++;
-			break;
-		case '1':
-			oneshot++;
-			/* fallthrough: oneshot implies emit */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(fd, MAX_CLIENTS) < 0) {
+		close(fd);
+		return -1;
+	}
+	atexit(remove_socket);
+	return fd;
+}
+
+static void
+drop_client(Client * c)
+{
+	epoll_ctl(EPFD, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+void
+accept_clients(void)
+{
+	struct epoll_event eev;
+	int fd, i;
+
+	while ((fd = accept(SOCKFD, NULL, NULL)) >= 0) {
+		for (i = 0; i < MAX_CLIENTS && CLIENTS[i].fd != -1; i++);
+		if (i == MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		CLIENTS[i].fd = fd;
+		CLIENTS[i].len = 0;
+		eev.events = EPOLLIN;
+		eev.data.fd = fd;
+		epoll_ctl(EPFD, EPOLL_CTL_ADD, fd, &eev);
+	}
+}
+
+static Client *
+find_client(int fd)
+{
+	int i;
+	for (i = 0; i < MAX_CLIENTS && CLIENTS[i].fd != fd; i++);
+	return i < MAX_CLIENTS ? &CLIENTS[i] : NULL;
+}
+
+/* Writes what the socket takes, polls for writability while data is left */
+void
+flush_client(Client * c)
+{
+	struct epoll_event eev;
+	ssize_t n;
+
+	while (c->len && (n = send(c->fd, c->buf, c->len, MSG_NOSIGNAL)) > 0) {
+		memmove(c->buf, c->buf + n, c->len - n);
+		c->len -= n;
+	}
+	if (c->len && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		drop_client(c);
+		return;
+	}
+	eev.events = EPOLLIN | (c->len ? EPOLLOUT : 0);
+	eev.data.fd = c->fd;
+	epoll_ctl(EPFD, EPOLL_CTL_MOD, c->fd, &eev);
+}
+
+static void
+handle_client(int fd, uint32_t events)
+{
+	Client *c;
+	char drain[256];
+	ssize_t n;
+
+	if (!(c = find_client(fd))) {
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		/* the only request is "stats", anything but data means the subscriber is gone */
+		while ((n = read(fd, drain, sizeof(drain) - 1)) > 0) {
+			drain[n] = 0;
+			if (strstr(drain, "stats")) {
+				reply_stats(c);
+				if (c->fd == -1) {
+					return;
+				}
+			}
+		}
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			drop_client(c);
+			return;
+		}
+	}
+	if (events & EPOLLOUT) {
+		flush_client(c);
+	}
+}
+
+/* Output names and EDID ids need no escaping beyond quotes and backslashes */
+static int
+json_string(char *buf, size_t size, const char *s)
+{
+	size_t n = 0;
+
+	for (; *s && n + 2 < size; s++) {
+		if (*s == '"' || *s == '\\') {
+			buf[n++] = '\\';
+		}
+		if ((unsigned char) *s >= 0x20) {
+			buf[n++] = *s;
+		}
+	}
+	buf[n] = 0;
+	return n;
+}
+
+static void
+send_client(Client * c, const char *line, int len)
+{
+	if (c->len + len > CLIENT_BUF_SIZE) {
+		drop_client(c);
+		return;
+	}
+	memcpy(c->buf + c->len, line, len);
+	c->len += len;
+	flush_client(c);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* Appends the percentiles of n latencies as a JSON object, sorting them in place */
+static int
+stats_stage(char *buf, size_t size, const char *name, uint64_t * v, int n)
+{
+	if (n == 0) {
+		return snprintf(buf, size, "\"%s\":null", name);
+	}
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+	return snprintf(buf, size, "\"%s\":{\"n\":%d,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu}",
+					name, n, (unsigned long) v[n / 2], (unsigned long) v[n * 9 / 10],
+					(unsigned long) v[n * 99 / 100], (unsigned long) v[n - 1]);
+}
+
+/* Answers a stats request with latency percentiles in microseconds, the
+ * handler queue and the open batch */
+static void
+reply_stats(Client * c)
+{
+	/* event: server time to dequeue, fetch: dequeue to output info,
+	 * spawn: output info to spawn, handler: spawn to exit, total: dequeue to exit */
+	static uint64_t v[5][STATS_SIZE];
+	static const char *names[5] = { "event", "fetch", "spawn", "handler", "total" };
+	char line[1024];
+	Sample *s;
+	Job *job;
+	uint32_t d;
+	int i, k, n[5] = { 0 }, len, queued = 0, pending = 0;
+
+	for (i = 0; i < STATS_SIZE; i++) {
+		s = &STATS[i];
+		if (!s->seq) {
+			continue;
+		}
+		/* the server clock is CLOCK_MONOTONIC in milliseconds on Linux, anything
+		 * implausible means it is not and the stage is left out */
+		d = (uint32_t) (s->dequeued / 1000) - (uint32_t) s->server;
+		if (s->server && d < 60000) {
+			v[0][n[0]++] = (uint64_t) d * 1000;
+		}
+		v[1][n[1]++] = s->fetched - s->dequeued;
+		if (s->spawned) {
+			v[2][n[2]++] = s->spawned - s->fetched;
+		}
+		if (s->exited) {
+			v[3][n[3]++] = s->exited - s->spawned;
+			v[4][n[4]++] = s->exited - s->dequeued;
+		}
+	}
+	for (job = JOBS; job; job = job->next) {
+		queued += !job->pid;
+	}
+	for (i = 0; i < NDISPLAYS; i++) {
+		pending += DISPLAYS[i].npending;
+	}
+
+	len = snprintf(line, sizeof(line), "{\"stats\":{\"samples\":%lu,\"queued\":%d,\"running\":%d,"
+				   "\"pending\":%d,\"latency_us\":{", NSAMPLES, queued, RUNNING, pending);
+	for (k = 0; k < 5; k++) {
+		len += stats_stage(line + len, sizeof(line) - len, names[k], v[k], n[k]);
+		len += snprintf(line + len, sizeof(line) - len, k < 4 ? "," : "}}}\n");
+	}
+	send_client(c, line, len);
+}
+
+/* Connects to a running daemon and prints its stats */
+static int
+query_stats(const char *path)
+{
+	struct sockaddr_un sa;
+	char buf[CLIENT_BUF_SIZE + 1], *line, *end;
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0
+		|| write(fd, "stats\n", 6) != 6) {
+		xerror("Could not connect to %s\n", path);
+	}
+	/* events may arrive before the answer, skip them */
+	while ((n = read(fd, buf + len, CLIENT_BUF_SIZE - len)) > 0) {
+		len += n;
+		buf[len] = 0;
+		for (line = buf; (end = strchr(line, '\n')); line = end + 1) {
+			if (strncmp(line, "{\"stats\":", 9) == 0) {
+				*end = 0;
+				printf("%s\n", line);
+				close(fd);
+				return EXIT_SUCCESS;
+			}
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+	close(fd);
+	return EXIT_FAILURE;
+}
+
+/* Appends one JSON line per batch to every subscriber, dropping those whose buffer is full */
+void
+publish(Event * evs, int n)
+{
+	static char line[CLIENT_BUF_SIZE];
+	char output[2 * OUTPUT_SIZE], display[2 * OUTPUT_SIZE], name[2 * EDID_TEXT_SIZE];
+	Event *ev;
+	int i, len;
+
+	if (SOCKFD < 0) {
+		return;
+	}
+	json_string(display, sizeof(display), evs[0].display ? evs[0].display : "");
+	len = snprintf(line, sizeof(line), "{\"display\":\"%s\",\"batch\":%lu,\"batchsize\":%d,\"outputs\":[",
+				   display, evs[0].batch, n);
+	for (i = 0; i < n && len < (int) sizeof(line); i++) {
+		ev = &evs[i];
+		json_string(output, sizeof(output), ev->output);
+		json_string(name, sizeof(name), ev->name);
+		len += snprintf(line + len, sizeof(line) - len,
+						"%s{\"output\":\"%s\",\"event\":\"%s\",\"edid\":\"%s\",\"name\":\"%s\",\"screenid\":%d,"
+						"\"crtc\":{\"x\":%d,\"y\":%d,\"width\":%u,\"height\":%u},\"timestamp\":%lu}",
+						i ? "," : "", output, ev->event, ev->edid, name, ev->sid, ev->x, ev->y, ev->width,
+						ev->height, (unsigned long) ev->timestamp);
+	}
+	if (len < (int) sizeof(line)) {
+		len += snprintf(line + len, sizeof(line) - len, "]}\n");
+	}
+	if (len < 0 || len >= (int) sizeof(line)) {
+		return;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (CLIENTS[i].fd != -1) {
+			send_client(&CLIENTS[i], line, len);
+		}
+	}
+}
+
+static unsigned int
+connection_slot(RROutput output)
+{
+	return ((uint32_t) output * 2654435761u) & (CONNECTIONS_SIZE - 1);
+}
+
+OutputConnection *
+get_output_connection(XDisplay * d, RROutput output)
+{
+	unsigned int i;
+	for (i = connection_slot(output); d->connections[i].output != None; i = (i + 1) & (CONNECTIONS_SIZE - 1)) {
+		if (d->connections[i].output == output) {
+			return &d->connections[i];
+		}
+	}
+	return NULL;
+}
+
+/* Linear probing with backward shift deletion, the table never needs tombstones */
+void
+remove_output_connection(XDisplay * d, RROutput output)
+{
+	OutputConnection *ocon;
+	unsigned int i, j, home;
+
+	if (!(ocon = get_output_connection(d, output))) {
+		return;
+	}
+	free(ocon->vcgt);
+	i = ocon - d->connections;
+	for (j = (i + 1) & (CONNECTIONS_SIZE - 1); d->connections[j].output != None; j = (j + 1) & (CONNECTIONS_SIZE - 1)) {
+		home = connection_slot(d->connections[j].output);
+		/* move j into the hole unless its home slot lies cyclically in (i, j] */
+		if (((j - home) & (CONNECTIONS_SIZE - 1)) >= ((j - i) & (CONNECTIONS_SIZE - 1))) {
+			d->connections[i] = d->connections[j];
+			i = j;
+		}
+	}
+	memset(&d->connections[i], 0, sizeof(OutputConnection));
+	d->nconnections--;
+}
+
+/* Inserts or updates the entry of output in place. One slot always stays
+ * free, so every probe sequence ends at an empty slot. */
+OutputConnection *
+cache_connection(XDisplay * d, RROutput output, char *edid, int edidlen, const char *name, int sid)
+{
+	unsigned int i;
+
+	for (i = connection_slot(output); d->connections[i].output != None && d->connections[i].output != output;
+		 i = (i + 1) & (CONNECTIONS_SIZE - 1));
+	if (d->connections[i].output == None) {
+		if (d->nconnections == CONNECTIONS_SIZE - 1) {
+			fprintf(stderr, "Connection cache full\n");
+			return NULL;
+		}
+		d->nconnections++;
+	}
+	else if (d->connections[i].edidlen != MIN(edidlen, EDID_SIZE)
+			 || memcmp(d->connections[i].edid, edid, d->connections[i].edidlen)) {
+		/* another monitor on the same connector */
+		free(d->connections[i].vcgt);
+		d->connections[i].vcgt = NULL;
+		d->connections[i].vcgtsize = 0;
+	}
+	d->connections[i].output = output;
+	d->connections[i].sid = sid;
+	d->connections[i].edidlen = MIN(edidlen, EDID_SIZE);
+	memset(d->connections[i].edid, 0, EDID_SIZE);
+	memcpy(d->connections[i].edid, edid, d->connections[i].edidlen);
+	snprintf(d->connections[i].name, EDID_TEXT_SIZE, "%s", name);
+	return &d->connections[i];
+}
+
+static int
+read_supply(const char *supply, const char *attr, char *buf, int size)
+{
+	char path[256];
+	FILE *f;
+	int ok;
+
+	snprintf(path, sizeof(path), POWER_SUPPLY "/%s/%s", supply, attr);
+	if (!(f = fopen(path, "r"))) {
+		return 0;
+	}
+	ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+	buf[strcspn(buf, "\n")] = 0;
+	return ok;
+}
+
+/* Whether a mains supply is online, machines without one count as on AC */
+static int
+on_ac(void)
+{
+	DIR *dir;
+	struct dirent *e;
+	char buf[32];
+	int mains = 0, online = 0;
+
+	if (!(dir = opendir(POWER_SUPPLY))) {
+		return 1;
+	}
+	while ((e = readdir(dir))) {
+		if (e->d_name[0] == '.' || !read_supply(e->d_name, "type", buf, sizeof(buf)) || strcmp(buf, "Mains")) {
+			continue;
+		}
+		mains = 1;
+		if (read_supply(e->d_name, "online", buf, sizeof(buf)) && strcmp(buf, "1") == 0) {
+			online = 1;
+		}
+	}
+	closedir(dir);
+	return !mains || online;
+}
+
+/* Vertical refresh in mHz */
+static unsigned long
+mode_refresh(XRRModeInfo * m)
+{
+	double vtotal = m->vTotal;
+
+	if (m->modeFlags & RR_DoubleScan) {
+		vtotal *= 2;
+	}
+	if (m->modeFlags & RR_Interlace) {
+		vtotal /= 2;
+	}
+	if (!m->hTotal || !vtotal) {
+		return 0;
+	}
+	return (unsigned long) ((double) m->dotClock * 1000 / ((double) m->hTotal * vtotal));
+}
+
+static XRRModeInfo *
+find_mode(XRRScreenResources * sr, RRMode id)
+{
+	int i;
+	for (i = 0; i < sr->nmode && sr->modes[i].id != id; i++);
+	return i < sr->nmode ? &sr->modes[i] : NULL;
+}
+
+/* Whether every output of the crtc supports the mode, infos holds their
+ * output infos so that candidate modes cost no round trips */
+static int
+outputs_have_mode(XRROutputInfo ** infos, int noutput, RRMode id)
+{
+	int i, j, found = 1;
+
+	for (i = 0; found && i < noutput; i++) {
+		for (j = 0; j < infos[i]->nmode && infos[i]->modes[j] != id; j++);
+		found = j < infos[i]->nmode;
+	}
+	return found;
+}
+
+static void
+free_output_infos(XRROutputInfo ** infos, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		XRRFreeOutputInfo(infos[i]);
+	}
+	free(infos);
+}
+
+/* Output infos of the outputs of the crtc, NULL if one is missing */
+static XRROutputInfo **
+get_output_infos(Display * dpy, XRRScreenResources * sr, XRRCrtcInfo * crtc)
+{
+	XRROutputInfo **infos;
+	int i;
+
+	infos = calloc(crtc->noutput, sizeof(XRROutputInfo *));
+	die_if_null(infos);
+	for (i = 0; i < crtc->noutput; i++) {
+		if (!(infos[i] = XRRGetOutputInfo(dpy, sr, crtc->outputs[i]))) {
+			free_output_infos(infos, i);
+			return NULL;
+		}
+	}
+	return infos;
+}
+
+/* Switches every active crtc of the screen to the lowest or highest refresh
+ * of its current resolution, one XRRSetCrtcConfig per crtc that changes */
+static void
+apply_refresh(Display * dpy, Window root, int high, int verbose)
+{
+	XRRScreenResources *sr;
+	XRRCrtcInfo *crtc;
+	XRROutputInfo **infos;
+	XRRModeInfo *cur, *m, *best;
+	int i, j;
+
+	if (!(sr = XRRGetScreenResourcesCurrent(dpy, root))) {
+		return;
+	}
+	for (i = 0; i < sr->ncrtc; i++) {
+		if (!(crtc = XRRGetCrtcInfo(dpy, sr, sr->crtcs[i]))) {
+			continue;
+		}
+		if (crtc->mode == None || !crtc->noutput || !(cur = find_mode(sr, crtc->mode))
+			|| !(infos = get_output_infos(dpy, sr, crtc))) {
+			XRRFreeCrtcInfo(crtc);
+			continue;
+		}
+		best = cur;
+		for (j = 0; j < sr->nmode; j++) {
+			m = &sr->modes[j];
+			if (m->width != cur->width || m->height != cur->height
+				|| (m->modeFlags & RR_Interlace) != (cur->modeFlags & RR_Interlace)) {
+				continue;
+			}
+			if ((high ? mode_refresh(m) > mode_refresh(best) : mode_refresh(m) < mode_refresh(best))
+				&& outputs_have_mode(infos, crtc->noutput, m->id)) {
+				best = m;
+			}
+		}
+		if (best != cur) {
+			if (verbose) {
+				printf("Refresh: crtc %lu %.2fHz -> %.2fHz\n", sr->crtcs[i],
+					   mode_refresh(cur) / 1000.0, mode_refresh(best) / 1000.0);
+			}
+			/* same size, so the screen needs no resize */
+			XRRSetCrtcConfig(dpy, sr, sr->crtcs[i], CurrentTime, crtc->x, crtc->y, best->id,
+							 crtc->rotation, crtc->outputs, crtc->noutput);
+		}
+		free_output_infos(infos, crtc->noutput);
+		XRRFreeCrtcInfo(crtc);
+	}
+	XRRFreeScreenResources(sr);
+}
+
+/* Applies the refresh policy to every screen if the power state changed */
+void
+apply_policy(int verbose)
+{
+	XDisplay *d;
+	int ac, s;
+
+	if ((ac = on_ac()) == ONAC) {
+		return;
+	}
+	ONAC = ac;
+	if (verbose) {
+		printf("Power: %s\n", ac ? "AC" : "battery");
+	}
+	for (d = DISPLAYS; d < DISPLAYS + NDISPLAYS; d++) {
+		for (s = 0; s < ScreenCount(d->dpy); s++) {
+			apply_refresh(d->dpy, RootWindow(d->dpy, s), ac, verbose);
+		}
+		XFlush(d->dpy);
+	}
+}
+
+/* sysfs attributes raise no inotify events, so inotify only sees supplies
+ * coming and going, where sysfs supports it, and kernel uevents carry the
+ * state changes */
+int
+open_power_watch(void)
+{
+	struct sockaddr_nl sa;
+
+	if ((INOTIFYFD = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0
+		&& inotify_add_watch(INOTIFYFD, POWER_SUPPLY, IN_CREATE | IN_DELETE) < 0) {
+		close(INOTIFYFD);
+		INOTIFYFD = -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = 1;           /* kernel uevents */
+	if ((UEVENTFD = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) < 0
+		|| bind(UEVENTFD, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Drains the uevent socket, returns whether a power supply changed */
+static int
+read_uevents(void)
+{
+	char buf[4096], *p;
+	ssize_t n;
+	int power = 0;
+
+	while ((n = recv(UEVENTFD, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[n] = 0;
+		for (p = buf; p < buf + n; p += strlen(p) + 1) {
+			if (strcmp(p, "SUBSYSTEM=power_supply") == 0) {
+				power = 1;
+			}
+		}
+	}
+	return power;
+}
+
+static int
+cmp_point(const void *a, const void *b)
+{
+	return ((const TempPoint *) a)->minute - ((const TempPoint *) b)->minute;
+}
+
+int
+parse_schedule(char *s)
+{
+	char *tok, *save;
+	int h, m, k, n;
+
+	for (tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (NSCHEDULE == MAX_SCHEDULE || sscanf(tok, "%d:%d=%d%n", &h, &m, &k, &n) != 3 || tok[n]
+			|| h < 0 || h > 23 || m < 0 || m > 59 || k < 1000 || k > 25000) {
+			return 0;
+		}
+		SCHEDULE[NSCHEDULE].minute = h * 60 + m;
+		SCHEDULE[NSCHEDULE].kelvin = k;
+		NSCHEDULE++;
+	}
+	qsort(SCHEDULE, NSCHEDULE, sizeof(TempPoint), cmp_point);
+	return NSCHEDULE > 0;
+}
+
+/* Temperature in effect at t, and when the next schedule point is due */
+static int
+scheduled_kelvin(time_t t, time_t * next)
+{
+	struct tm tm;
+	int minute, i;
+
+	localtime_r(&t, &tm);
+	minute = tm.tm_hour * 60 + tm.tm_min;
+	for (i = 0; i < NSCHEDULE && SCHEDULE[i].minute <= minute; i++);
+	if (next) {
+		/* past the last point the first one of tomorrow is next */
+		tm.tm_mday += i == NSCHEDULE;
+		tm.tm_hour = SCHEDULE[i % NSCHEDULE].minute / 60;
+		tm.tm_min = SCHEDULE[i % NSCHEDULE].minute % 60;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		*next = mktime(&tm);
+	}
+	/* before the first point the last one of yesterday holds */
+	return SCHEDULE[(i + NSCHEDULE - 1) % NSCHEDULE].kelvin;
+}
+
+/* Calibration ramps of output resampled to size entries, or NULL without
+ * a profile. The lookup is remembered until the monitor goes away, so
+ * fades and later batches do not touch the disk again. */
+static unsigned short *
+calibration(XDisplay * d, RROutput output, int size)
+{
+	OutputConnection *ocon;
+	char edid[EDID_SIZE], name[EDID_TEXT_SIZE], path[4096];
+	int edidlen;
+
+	if (!(ocon = get_output_connection(d, output))) {
+		/* connected before srandrd started */
+		edidlen = get_edid(d->dpy, output, edid, EDID_SIZE, name);
+		if (!(ocon = cache_connection(d, output, edid, edidlen, name, -1))) {
+			return NULL;
+		}
+	}
+	if (ocon->vcgtsize == size || !ocon->edidlen) {
+		return ocon->vcgt;
+	}
+	free(ocon->vcgt);
+	ocon->vcgt = malloc(3 * size * sizeof(unsigned short));
+	ocon->vcgtsize = size;
+	snprintf(path, sizeof(path), "%s/%s.icc", ICCDIR, ocon->edid);
+	if (ocon->vcgt && !icc_load_vcgt(path, size, ocon->vcgt, ocon->vcgt + size, ocon->vcgt + 2 * size)) {
+		free(ocon->vcgt);
+		ocon->vcgt = NULL;
+	}
+	return ocon->vcgt;
+}
+
+/* Looks up the crtcs of every screen with their gamma sizes and, for
+ * calibration, first outputs */
+static void
+get_crtc_ramps(XDisplay * d)
+{
+	XRRScreenResources *sr;
+	XRRCrtcInfo *ci;
+	CrtcRamp *cr;
+	int s, i;
+
+	free(d->crtcs);
+	d->crtcs = NULL;
+	d->ncrtcs = 0;
+	for (s = 0; s < ScreenCount(d->dpy); s++) {
+		if (!(sr = XRRGetScreenResourcesCurrent(d->dpy, RootWindow(d->dpy, s)))) {
+			continue;
+		}
+		d->crtcs = realloc(d->crtcs, (d->ncrtcs + sr->ncrtc + 1) * sizeof(CrtcRamp));
+		die_if_null(d->crtcs);
+		for (i = 0; i < sr->ncrtc; i++) {
+			cr = &d->crtcs[d->ncrtcs++];
+			cr->crtc = sr->crtcs[i];
+			cr->output = None;
+			cr->size = XRRGetCrtcGammaSize(d->dpy, cr->crtc);
+			if (ICCDIR && cr->size && (ci = XRRGetCrtcInfo(d->dpy, sr, cr->crtc))) {
+				if (ci->noutput) {
+					cr->output = ci->outputs[0];
+				}
+				XRRFreeCrtcInfo(ci);
+			}
+		}
+		XRRFreeScreenResources(sr);
+	}
+	/* a display without crtcs is looked up once as well */
+	if (!d->crtcs) {
+		d->crtcs = malloc(sizeof(CrtcRamp));
+		die_if_null(d->crtcs);
+	}
+}
+
+/* Sends the calibration of the crtc's first output, or linear ramps,
+ * scaled to the white point. Without a white point only calibrated crtcs
+ * are touched. */
+static void
+send_ramps(XDisplay * d, CrtcRamp * cr)
+{
+	XRRCrtcGamma *gamma;
+	unsigned short *vcgt = NULL;
+	int size = cr->size;
+
+	if (!size) {
+		return;
+	}
+	if (ICCDIR && cr->output != None) {
+		vcgt = calibration(d, cr->output, size);
+	}
+	if ((!vcgt && !WHITESET) || !(gamma = XRRAllocGamma(size))) {
+		return;
+	}
+	if (vcgt) {
+		memcpy(gamma->red, vcgt, size * sizeof(unsigned short));
+		memcpy(gamma->green, vcgt + size, size * sizeof(unsigned short));
+		memcpy(gamma->blue, vcgt + 2 * size, size * sizeof(unsigned short));
+		if (WHITESET) {
+			gamma_scale(gamma->red, gamma->green, gamma->blue, size, WHITE);
+		}
+	}
+	else {
+		gamma_white(gamma->red, gamma->green, gamma->blue, size, WHITE);
+	}
+	XRRSetCrtcGamma(d->dpy, cr->crtc, gamma);
+	XRRFreeGamma(gamma);
+}
+
+/* Sends the calibrated white point ramps to every crtc of the display,
+ * only the first call after a batch asks the server about the crtcs */
+static void
+apply_ramps(XDisplay * d)
+{
+	int i;
+
+	if (!d->crtcs) {
+		get_crtc_ramps(d);
+	}
+	for (i = 0; i < d->ncrtcs; i++) {
+		send_ramps(d, &d->crtcs[i]);
+	}
+	XFlush(d->dpy);
+}
+
+/* Steps whose quantized white point, and so every ramp entry, did not change are skipped */
+static void
+set_temperature(double kelvin)
+{
+	double w[3];
+	unsigned short q[3];
+	int c;
+
+	gamma_blackbody(kelvin, w);
+	for (c = 0; c < 3; c++) {
+		q[c] = w[c] * 65535 + 0.5;
+	}
+	if (WHITESET && memcmp(q, WHITE, sizeof(WHITE)) == 0) {
+		return;
+	}
+	memcpy(WHITE, q, sizeof(WHITE));
+	WHITESET = 1;
+	for (c = 0; c < NDISPLAYS; c++) {
+		apply_ramps(&DISPLAYS[c]);
+	}
+}
+
+static void
+arm_timer(void)
+{
+	struct itimerspec its;
+	time_t next;
+
+	memset(&its, 0, sizeof(its));
+	if (FADING) {
+		its.it_value.tv_nsec = its.it_interval.tv_nsec = FADE_STEP_MS * 1000000L;
+		timerfd_settime(TIMERFD, 0, &its, NULL);
+	}
+	else {
+		scheduled_kelvin(time(NULL), &next);
+		its.it_value.tv_sec = next;
+		timerfd_settime(TIMERFD, TFD_TIMER_ABSTIME, &its, NULL);
+	}
+}
+
+static void
+start_fade(int kelvin)
+{
+	FADEFROM = KELVIN;
+	FADETO = kelvin;
+	FADESTART = now_us();
+	FADING = FADE > 0 && kelvin != KELVIN;
+	if (!FADING) {
+		KELVIN = kelvin;
+		set_temperature(KELVIN);
+	}
+	arm_timer();
+}
+
+/* Advances the fade or, at a schedule point, starts the next one */
+static void
+temperature_tick(void)
+{
+	uint64_t expirations;
+	double p;
+
+	if (read(TIMERFD, &expirations, sizeof(expirations)) < 0) {
+		return;
+	}
+	if (!FADING) {
+		start_fade(scheduled_kelvin(time(NULL), NULL));
+		return;
+	}
+	p = (double) (now_us() - FADESTART) / (FADE * 1000000.0);
+	if (p >= 1) {
+		p = 1;
+		FADING = 0;
+	}
+	/* steps of equal size in mired look equally large */
+	KELVIN = 1000000 / (1000000 / FADEFROM + (1000000 / FADETO - 1000000 / FADEFROM) * p);
+	set_temperature(KELVIN);
+	if (!FADING) {
+		arm_timer();
+	}
+}
+
+static void
+handle_output(XDisplay * d, XRRScreenResources * sr, Snapshot * snap, Change * change, int verbose)
+{
+	XRROutputInfo *info;
+	OutputConnection *ocon;
+	Sample *sample;
+	Display *dpy = d->dpy;
+	RROutput output = change->output;
+	Event e;
+	int edidlen = 0;
+
+	memset(&e, 0, sizeof(Event));
+	e.sid = -1;
+	e.batch = BATCH;
+	e.display = d->name;
+
+	info = XRRGetOutputInfo(dpy, sr, output);
+	if (info == NULL) {
+		fprintf(stderr, "Could not get output info\n");
+		return;
+	}
+	sample = new_sample();
+	sample->server = info->timestamp;
+	sample->dequeued = change->dequeued;
+	sample->fetched = now_us();
+	e.sample = sample->seq;
+	fill_event(dpy, sr, info, &e);
+
+	if (info->connection == RR_Disconnected) {
+		/* retrieve edid and screen information from cache */
+		if ((ocon = get_output_connection(d, output))) {
+			e.sid = ocon->sid;
+			edidlen = ocon->edidlen;
+			memcpy(e.edid, ocon->edid, edidlen);
+			memcpy(e.name, ocon->name, EDID_TEXT_SIZE);
+			remove_output_connection(d, output);
+		}
+	}
+	else {
+		edidlen = get_edid(dpy, output, e.edid, EDID_SIZE, e.name);
+		/* one snapshot serves every output of the screen */
+		if (!snap->mi && snap->nmonitors != -1 && !take_snapshot(dpy, change->root, snap)) {
+			snap->nmonitors = -1;
+		}
+		if (snap->mi) {
+			e.sid = get_sid(snap, output);
+		}
+		cache_connection(d, output, e.edid, edidlen, e.name, e.sid);
+	}
+
+	if (verbose) {
+		printf("Event: %s %s %s (batch %lu)\n", d->name, info->name, e.event, e.batch);
+		printf("Time: %lu\n", info->timestamp);
+		if (info->crtc == 0) {
+			printf("Size: %lumm x %lumm\n", info->mm_width, info->mm_height);
+		}
+		else {
+			printf("CRTC: %lu\n", info->crtc);
+			printf("Size: %ux%u\n", e.width, e.height);
+		}
+		if (edidlen) {
+			printf("EDID (vendor, product, serial): %s\n", e.edid);
+			if (e.name[0]) {
+				printf("Monitor: %s\n", e.name);
+			}
+		}
+		else {
+			printf("EDID (vendor, product, serial): not available\n");
+		}
+	}
+	emit(dpy, &e);
+	XRRFreeOutputInfo(info);
+}
+
+/* Emits the final state of every output changed in the batch as one
+ * event, screen by screen, probing only on request */
+static void
+handle_batch(XDisplay * d, int verbose)
+{
+	Snapshot snap;
+	XRRScreenResources *sr;
+	char done[MAX_PENDING];
+	Window root, roots[MAX_PENDING];
+	int i, j, nroots = 0;
+
+	BATCH++;
+	memset(done, 0, sizeof(done));
+	for (i = 0; i < d->npending; i++) {
+		if (done[i]) {
+			continue;
+		}
+		root = roots[nroots++] = d->pending[i].root;
+		if (PROBE) {
+			sr = XRRGetScreenResources(d->dpy, root);
+		}
+		else {
+			sr = XRRGetScreenResourcesCurrent(d->dpy, root);
+		}
+		if (sr == NULL) {
+			fprintf(stderr, "Could not get screen resources\n");
+		}
+		memset(&snap, 0, sizeof(Snapshot));
+		for (j = i; j < d->npending; j++) {
+			if (d->pending[j].root != root) {
+				continue;
+			}
+			done[j] = 1;
+			if (sr) {
+				handle_output(d, sr, &snap, &d->pending[j], verbose);
+			}
+		}
+		if (sr) {
+			XRRFreeScreenResources(sr);
+		}
+		free_snapshot(&snap);
+	}
+	d->npending = 0;
+	emit_batch();
+	/* outputs plugged in since the last power change get its refresh too */
+	if (POLICY && ONAC != -1) {
+		for (i = 0; i < nroots; i++) {
+			apply_refresh(d->dpy, roots[i], ONAC, verbose);
+		}
+		XFlush(d->dpy);
+	}
+	/* outputs may have moved to other crtcs */
+	free(d->crtcs);
+	d->crtcs = NULL;
+	/* crtcs that just lit up start with the server's ramps */
+	if (WHITESET || ICCDIR) {
+		apply_ramps(d);
+	}
+}
+
+/* Adds the output of an output change to the batch, opening one if needed */
+static void
+queue_change(XDisplay * d, XEvent * ev, int verbose)
+{
+	int i;
+
+	if (ev->type != d->rrevent + RRNotify || ((XRRNotifyEvent *) ev)->subtype != RRNotify_OutputChange) {
+		return;
+	}
+	for (i = 0; i < d->npending && d->pending[i].output != OCNE(ev)->output; i++);
+	if (i < d->npending) {
+		return;
+	}
+	if (d->npending == MAX_PENDING) {
+		handle_batch(d, verbose);
+	}
+	if (d->npending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &d->deadline);
+		d->deadline.tv_sec += WINDOW / 1000;
+		d->deadline.tv_nsec += (WINDOW % 1000) * 1000000L;
+		if (d->deadline.tv_nsec >= 1000000000L) {
+			d->deadline.tv_sec++;
+			d->deadline.tv_nsec -= 1000000000L;
+		}
+	}
+	d->pending[d->npending].output = OCNE(ev)->output;
+	d->pending[d->npending].root = OCNE(ev)->window;
+	d->pending[d->npending].dequeued = now_us();
+	d->npending++;
+}
+
+/* Milliseconds until the open batch is due, rounded up, or -1 without one */
+static int
+batch_timeout(XDisplay * d)
+{
+	struct timespec now;
+	long ms;
+
+	if (!d->npending) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (d->deadline.tv_sec - now.tv_sec) * 1000 + (d->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+void
+open_display(const char *name)
+{
+	XDisplay *d;
+	int error;
+
+	if (NDISPLAYS == MAX_DISPLAYS) {
+		xerror("Too many displays\n");
+	}
+	if (!DISPLAYS) {
+		DISPLAYS = calloc(MAX_DISPLAYS, sizeof(XDisplay));
+		die_if_null(DISPLAYS);
+	}
+	d = &DISPLAYS[NDISPLAYS];
+	if ((d->dpy = XOpenDisplay(name)) == NULL) {
+		xerror("Cannot open display %s\n", name ? name : "");
+	}
+	if (!XRRQueryExtension(d->dpy, &d->rrevent, &error)) {
+		xerror("RandR extension missing on %s\n", DisplayString(d->dpy));
+	}
+	d->name = DisplayString(d->dpy);
+	NDISPLAYS++;
+}
+
+int
+process_events(int verbose)
+{
+	struct epoll_event eev, events[6 + MAX_CLIENTS + MAX_DISPLAYS];
+	XDisplay *d;
+	XEvent ev;
+	char drain[64], ibuf[4096];
+	int i, n, s, timeout, t;
+
+	XSetIOErrorHandler((XIOErrorHandler) error_handler);
+	eev.events = EPOLLIN;
+	for (d = DISPLAYS; d < DISPLAYS + NDISPLAYS; d++) {
+		for (s = 0; s < ScreenCount(d->dpy); s++) {
+			XRRSelectInput(d->dpy, RootWindow(d->dpy, s), RROutputChangeNotifyMask);
+		}
+		XSync(d->dpy, False);
+		eev.data.fd = ConnectionNumber(d->dpy);
+		epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+	}
+	eev.data.fd = CHILDPIPE[0];
+	epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+	if (POLICY) {
+		if (!open_power_watch()) {
+			xerror("Could not watch " POWER_SUPPLY "\n");
+		}
+		if (INOTIFYFD >= 0) {
+			eev.data.fd = INOTIFYFD;
+			epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+		}
+		eev.data.fd = UEVENTFD;
+		epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+		apply_policy(verbose);
+	}
+	if (NSCHEDULE) {
+		if ((TIMERFD = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+			xerror("Could not create timer\n");
+		}
+		eev.data.fd = TIMERFD;
+		epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+		start_fade(scheduled_kelvin(time(NULL), NULL));
+	}
+	if (ICCDIR) {
+		for (d = DISPLAYS; d < DISPLAYS + NDISPLAYS; d++) {
+			apply_ramps(d);
+		}
+	}
+	if (SOCKFD >= 0) {
+		eev.data.fd = SOCKFD;
+		epoll_ctl(EPFD, EPOLL_CTL_ADD, eev.data.fd, &eev);
+	}
+
+	while (1) {
+		timeout = -1;
+		for (d = DISPLAYS; d < DISPLAYS + NDISPLAYS; d++) {
+			/* XPending reads the socket, displays that did not wake us only
+			 * need a look at what replies already queued */
+			while (XQLength(d->dpy)) {
+				XNextEvent(d->dpy, &ev);
+				queue_change(d, &ev, verbose);
+			}
+			if (d->npending && batch_timeout(d) == 0) {
+				handle_batch(d, verbose);
+			}
+			if ((t = batch_timeout(d)) >= 0 && (timeout < 0 || t < timeout)) {
+				timeout = t;
+			}
+		}
+		if ((n = epoll_wait(EPFD, events, 6 + MAX_CLIENTS + MAX_DISPLAYS, timeout)) < 0 && errno != EINTR) {
+			xerror("epoll_wait failed\n");
+		}
+		for (i = 0; i < n; i++) {
+			for (d = DISPLAYS; d < DISPLAYS + NDISPLAYS && ConnectionNumber(d->dpy) != events[i].data.fd; d++);
+			if (d < DISPLAYS + NDISPLAYS) {
+				while (XPending(d->dpy)) {
+					XNextEvent(d->dpy, &ev);
+					queue_change(d, &ev, verbose);
+				}
+			}
+			else if (events[i].data.fd == CHILDPIPE[0]) {
+				while (read(CHILDPIPE[0], drain, sizeof(drain)) > 0);
+				if (RELOAD) {
+					RELOAD = 0;
+					load_rules(RULESPATH);
+				}
+				reap_jobs();
+			}
+			else if (events[i].data.fd == TIMERFD) {
+				temperature_tick();
+			}
+			else if (events[i].data.fd == INOTIFYFD) {
+				while (read(INOTIFYFD, ibuf, sizeof(ibuf)) > 0);
+				apply_policy(verbose);
+			}
+			else if (events[i].data.fd == UEVENTFD) {
+				if (read_uevents()) {
+					apply_policy(verbose);
+				}
+			}
+			else if (events[i].data.fd == SOCKFD) {
+				accept_clients();
+			}
+			else {
+				handle_client(events[i].data.fd, events[i].events);
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+	int daemonize = 1, args = 1, verbose = 0, emit = 0, list = 0, oneshot = 0;
+	int i, rv = 0, nplugins = 0, ndisplays = 0;
+	char *plugins[MAX_PLUGINS], *displays[MAX_DISPLAYS];
+	uid_t uid;
+
+	if (argc < 2) {
+		help(EXIT_FAILURE);
+	}
+
+	for (args = 1; args < argc && *(argv[args]) == '-'; args++) {
+		switch (argv[args][1]) {
+		case 'V':
+			version();
+		case 'n':
+			daemonize = 0;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case '1':
+			oneshot++;
+			/* fallthrough: oneshot implies emit */
 		case 'e':
 			emit++;
 			break;
+		case 'j':
+			if (++args >= argc || (MAXJOBS = atoi(argv[args])) < 1) {
+				help(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			if (++args >= argc) {
+				help(EXIT_FAILURE);
+			}
+			SOCKPATH = argv[args];
+			break;
+		case 'p':
+			if (++args >= argc || nplugins == MAX_PLUGINS) {
+				help(EXIT_FAILURE);
+			}
+			plugins[nplugins++] = argv[args];
+			break;
+		case 'd':
+			if (++args >= argc || (WINDOW = atoi(argv[args])) < 0) {
+				help(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			PROBE = 1;
+			break;
+		case 'B':
+			ONCE = 1;
+			break;
+		case 'b':
+			POLICY = 1;
+			break;
+		case 't':
+			if (++args >= argc || !parse_schedule(argv[args])) {
+				help(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			if (++args >= argc || (FADE = atoi(argv[args])) < 0) {
+				help(EXIT_FAILURE);
+			}
+			break;
+		case 'c':
+			if (++args >= argc) {
+				help(EXIT_FAILURE);
+			}
+			ICCDIR = argv[args];
+			break;
+		case 'D':
+			if (++args >= argc || ndisplays == MAX_DISPLAYS) {
+				help(EXIT_FAILURE);
+			}
+			displays[ndisplays++] = argv[args];
+			break;
+		case 'r':
+			if (++args >= argc) {
+				help(EXIT_FAILURE);
+			}
+			RULESPATH = argv[args];
+			break;
 		case 'h':
 			help(EXIT_SUCCESS);
 		default:
@@ -458,24 +2233,47 @@ main(int argc, char **argv)
 			help(EXIT_FAILURE);
 		}
 	}
-	if (argv[args] == NULL) {
+	if (argv[args] == NULL && !SOCKPATH && !nplugins && !RULESPATH && !POLICY && !NSCHEDULE && !ICCDIR) {
 		help(EXIT_FAILURE);
 	}
 
-	if (strncmp("list", argv[args], 5) == 0) {
+	if (argv[args] && strncmp("list", argv[args], 5) == 0) {
 		list = 1;
 	}
+	if (argv[args] && strncmp("stats", argv[args], 6) == 0) {
+		if (!SOCKPATH) {
+			help(EXIT_FAILURE);
+		}
+		return query_stats(SOCKPATH);
+	}
 
 	if (((uid = getuid()) == 0) || uid != geteuid()) {
 		xerror("This program may not run as root\n");
 	}
 
-	if ((dpy = XOpenDisplay(NULL)) == NULL) {
-		xerror("Cannot open display\n");
+	if (ndisplays == 0) {
+		open_display(NULL);
+	}
+	for (i = 0; i < ndisplays; i++) {
+		open_display(displays[i]);
 	}
 
 	if (list) {
-		return iter_crtcs(dpy, &print_crtc);
+		for (i = 0; i < NDISPLAYS; i++) {
+			iter_crtcs(&DISPLAYS[i], &print_crtc);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	/* before daemonizing, so load errors are still visible */
+	for (i = 0; i < nplugins; i++) {
+		load_plugin(plugins[i]);
+	}
+	if (RULESPATH && !load_rules(RULESPATH)) {
+		exit(EXIT_FAILURE);
+	}
+	if (SOCKPATH && !claim_socket(SOCKPATH)) {
+		xerror("Another " NAME " is listening on %s\n", SOCKPATH);
 	}
 
 	if (daemonize) {
@@ -493,15 +2291,41 @@ main(int argc, char **argv)
 		close(STDERR_FILENO);
 		close(STDOUT_FILENO);
 	}
+	if (pipe(CHILDPIPE) < 0) {
+		xerror("Could not create pipe\n");
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(CHILDPIPE[i], F_SETFD, FD_CLOEXEC);
+		fcntl(CHILDPIPE[i], F_SETFL, O_NONBLOCK);
+	}
+	/* handlers must not inherit the X connections */
+	for (i = 0; i < NDISPLAYS; i++) {
+		fcntl(ConnectionNumber(DISPLAYS[i].dpy), F_SETFD, FD_CLOEXEC);
+	}
 	signal(SIGCHLD, catch_child);
+	if (RULESPATH) {
+		signal(SIGHUP, catch_hup);
+	}
+
+	if ((EPFD = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		xerror("Could not create epoll instance\n");
+	}
+	if (SOCKPATH && (SOCKFD = open_socket(SOCKPATH)) < 0) {
+		xerror("Could not listen on %s\n", SOCKPATH);
+	}
 
 	ARGV = argv;
 	ARGS = args;
 
 	if (emit)
-		rv = iter_crtcs(dpy, &emit_crtc);
+		for (i = 0; i < NDISPLAYS; i++) {
+			rv = iter_crtcs(&DISPLAYS[i], &emit_crtc);
+			emit_batch();
+		}
+	if (oneshot)
+		wait_jobs();
 	if (!oneshot)
-		rv = process_events(dpy, verbose);
+		rv = process_events(verbose);
 	return rv;
 }
 
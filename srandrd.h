@@ -0,0 +1,17 @@
+/* See LICENSE for copyright and license details
+ * srandrd plugin interface
+ *
+ * A plugin is a shared object loaded with -p that exports
+ *
+ *	void srandrd_plugin(Display *dpy, const char *output, const char *event,
+ *	                    const char *edid, int screenid);
+ *
+ * It is called for every event before handlers are spawned, on the event loop
+ * and with srandrd's own X connection. It must return quickly and must not
+ * read events from or close the connection. screenid is -1 if unknown.
+ */
+
+#define SRANDRD_PLUGIN_SYMBOL "srandrd_plugin"
+
+typedef void (*SrandrdPlugin) (Display * dpy, const char *output, const char *event,
+							   const char *edid, int screenid);
@@ -1,8 +1,12 @@
 /* See LICENSE file for copyright and license details. */
+#include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -38,6 +42,35 @@ die(const char *fmt, ...) {
 	exit(1);
 }
 
+/* creates the parent directories of path */
+int
+mkdirs(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+	return 0;
+}
+
+uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--)
+		h = (h ^ *p++) * FNV_PRIME;
+	return h;
+}
+
 char *
 run_command(const char *cmd)
 {
@@ -74,3 +107,7 @@ void timespec_diff(struct timespec *res, struct timespec *a, struct timespec *b)
 int32_t timespec_to_ms(struct timespec *ts) {
     return ts->tv_sec*1000 + ts->tv_nsec/1000000;
 }
+
+int64_t timespec_to_us(struct timespec *ts) {
+    return (int64_t) ts->tv_sec*1000000 + ts->tv_nsec/1000;
+}
@@ -4,9 +4,15 @@
 #define MIN(A, B)               ((A) < (B) ? (A) : (B))
 #define BETWEEN(X, A, B)        ((A) <= (X) && (X) <= (B))
 
+#define FNV_OFFSET              0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
 void die(const char *fmt, ...);
 void *ecalloc(size_t nmemb, size_t size);
+int mkdirs(char *path);
+uint64_t fnv1a(uint64_t h, const void *data, size_t len);
 char * run_command(const char *cmd);
 void timespec_set_ms(struct timespec *ts, int32_t ms);
 int32_t timespec_to_ms(struct timespec *ts);
+int64_t timespec_to_us(struct timespec *ts);
 void timespec_diff(struct timespec *res, struct timespec *a, struct timespec *b);
\ No newline at end of file
@@ -45,6 +45,8 @@
 #include "config.h"
 #endif
 
+#include "gamma.h"
+
 static char	*program_name;
 static Display	*dpy;
 static Window	root;
@@ -204,12 +206,6 @@ argerr (const char *format, ...)
     /*NOTREACHED*/
 }
 
-/* Because fmin requires C99 suppport */
-static inline double dmin (double x, double y)
-{
-    return x < y ? x : y;
-}
-
 static const char *
 rotation_name (Rotation rotation)
 {
@@ -456,6 +452,8 @@ static int	fb_width_mm = 0, fb_height_mm = 0;
 static double	dpi = 0;
 static char	*dpi_output_name = NULL;
 static Bool	dryrun = False;
+static Bool	lean_query = False;	/* plain --query, fetch only what it prints */
+static RROutput	primary_xid = None;
 static int	minWidth, maxWidth, minHeight, maxHeight;
 static Bool    	has_1_2 = False;
 static Bool    	has_1_3 = False;
@@ -755,6 +753,107 @@ equal_transform (transform_t *a, transform_t *b)
     return True;
 }
 
+/*
+ * Open addressing index from names or XIDs to objects. Lookups scan the
+ * outputs, crtcs and modes linearly only until the indices are built,
+ * right after they were read from the server. Servers with hundreds of
+ * modes made those scans quadratic.
+ */
+typedef struct {
+    const char	*key;	/* NULL in indices by XID */
+    XID		xid;
+    void	*value;	/* NULL for a free slot */
+    int		mark;	/* scratch space of the code using the index */
+} index_entry_t;
+
+typedef struct {
+    index_entry_t   *entries;
+    unsigned int    mask;	/* size - 1, the size is a power of two */
+} index_t;
+
+static unsigned int
+hash_string (const char *s)
+{
+    unsigned int h = 2166136261u;
+
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static unsigned int
+hash_xid (XID xid)
+{
+    return (unsigned int) xid * 2654435761u;
+}
+
+static void
+index_init (index_t *index, int n)
+{
+    unsigned int size = 16;
+
+    /* at most half full, so probe sequences stay short */
+    while (size < 2 * (unsigned int) n)
+        size <<= 1;
+    free (index->entries);
+    index->entries = calloc (size, sizeof (index_entry_t));
+    if (!index->entries)
+        fatal ("out of memory\n");
+    index->mask = size - 1;
+}
+
+static index_entry_t *
+index_lookup (index_t *index, const char *key)
+{
+    unsigned int i;
+
+    for (i = hash_string (key) & index->mask; index->entries[i].value; i = (i + 1) & index->mask)
+        if (!strcmp (index->entries[i].key, key))
+            return &index->entries[i];
+    return NULL;
+}
+
+static index_entry_t *
+index_lookup_xid (index_t *index, XID xid)
+{
+    unsigned int i;
+
+    for (i = hash_xid (xid) & index->mask; index->entries[i].value; i = (i + 1) & index->mask)
+        if (index->entries[i].xid == xid)
+            return &index->entries[i];
+    return NULL;
+}
+
+/* The first object added under a key wins, like it did for linear scans */
+static void
+index_add (index_t *index, const char *key, void *value)
+{
+    unsigned int i;
+
+    for (i = hash_string (key) & index->mask; index->entries[i].value; i = (i + 1) & index->mask)
+        if (!strcmp (index->entries[i].key, key))
+            return;
+    index->entries[i].key = key;
+    index->entries[i].value = value;
+}
+
+static void
+index_add_xid (index_t *index, XID xid, void *value)
+{
+    unsigned int i;
+
+    for (i = hash_xid (xid) & index->mask; index->entries[i].value; i = (i + 1) & index->mask)
+        if (index->entries[i].xid == xid)
+            return;
+    index->entries[i].xid = xid;
+    index->entries[i].value = value;
+}
+
+static Bool	outputs_indexed;
+static index_t	output_names, output_xids;
+static output_t	**outputs_by_index;
+static int	num_outputs_by_index;
+
 static output_t *
 add_output (void)
 {
@@ -767,14 +866,56 @@ add_output (void)
     output->brightness = 1.0;
     *all_outputs_tail = output;
     all_outputs_tail = &output->next;
+    outputs_indexed = False;
     return output;
 }
 
+static void
+build_output_index (void)
+{
+    output_t	*output;
+    int		n = 0;
+
+    num_outputs_by_index = res ? res->noutput : 0;
+    free (outputs_by_index);
+    outputs_by_index = calloc (num_outputs_by_index + 1, sizeof (output_t *));
+    if (!outputs_by_index)
+        fatal ("out of memory\n");
+    for (output = all_outputs; output; output = output->next)
+        n++;
+    index_init (&output_names, n);
+    index_init (&output_xids, n);
+    for (output = all_outputs; output; output = output->next)
+    {
+        name_t *name = &output->output;
+
+        if (name->kind & name_string)
+            index_add (&output_names, name->string, output);
+        if (name->kind & name_xid)
+            index_add_xid (&output_xids, name->xid, output);
+        if ((name->kind & name_index) && name->index >= 0 && name->index < num_outputs_by_index &&
+            !outputs_by_index[name->index])
+            outputs_by_index[name->index] = output;
+    }
+    outputs_indexed = True;
+}
+
 static output_t *
 find_output (name_t *name)
 {
-    output_t *output;
+    output_t	    *output;
+    index_entry_t   *e;
 
+    if (outputs_indexed)
+    {
+        if ((name->kind & name_xid) && (e = index_lookup_xid (&output_xids, name->xid)))
+            return e->value;
+        if ((name->kind & name_string) && (e = index_lookup (&output_names, name->string)))
+            return e->value;
+        if ((name->kind & name_index) && name->index >= 0 && name->index < num_outputs_by_index)
+            return outputs_by_index[name->index];
+        return NULL;
+    }
     for (output = all_outputs; output; output = output->next)
     {
         name_kind_t common = name->kind & output->output.kind;
@@ -809,12 +950,34 @@ find_output_by_name (char *name)
     return find_output (&output_name);
 }
 
+static index_t	crtc_xids;
+
+/* crtcs only have XIDs and indices, and crtcs[c] has index c */
+static void
+build_crtc_index (void)
+{
+    int	    c;
+
+    index_init (&crtc_xids, num_crtcs);
+    for (c = 0; c < num_crtcs; c++)
+        index_add_xid (&crtc_xids, crtcs[c].crtc.xid, &crtcs[c]);
+}
+
 static crtc_t *
 find_crtc (name_t *name)
 {
-    int	    c;
-    crtc_t  *crtc = NULL;
+    int		    c;
+    crtc_t	    *crtc = NULL;
+    index_entry_t   *e;
 
+    if (crtc_xids.entries)
+    {
+        if ((name->kind & name_xid) && (e = index_lookup_xid (&crtc_xids, name->xid)))
+            return e->value;
+        if ((name->kind & name_index) && name->index >= 0 && name->index < num_crtcs)
+            return &crtcs[name->index];
+        return NULL;
+    }
     for (c = 0; c < num_crtcs; c++)
     {
         name_kind_t common;
@@ -843,34 +1006,63 @@ find_crtc_by_xid (RRCrtc crtc)
     return find_crtc (&crtc_name);
 }
 
+static index_t	mode_names, mode_xids;
+static int	*mode_next;	/* next mode of the same name in res, -1 after the last */
+
+/* Modes of one name are chained in the order of res, the index holds the first */
+static void
+build_mode_index (void)
+{
+    index_entry_t   *e;
+    int		    m;
+
+    index_init (&mode_names, res->nmode);
+    index_init (&mode_xids, res->nmode);
+    free (mode_next);
+    mode_next = calloc (res->nmode + 1, sizeof (int));
+    if (!mode_next)
+        fatal ("out of memory\n");
+    for (m = 0; m < res->nmode; m++)
+        index_add_xid (&mode_xids, res->modes[m].id, &res->modes[m]);
+    for (m = res->nmode - 1; m >= 0; m--)
+    {
+        mode_next[m] = -1;
+        if ((e = index_lookup (&mode_names, res->modes[m].name)))
+        {
+            mode_next[m] = (XRRModeInfo *) e->value - res->modes;
+            e->key = res->modes[m].name;
+            e->value = &res->modes[m];
+        }
+        else
+            index_add (&mode_names, res->modes[m].name, &res->modes[m]);
+    }
+}
+
 static XRRModeInfo *
 find_mode (name_t *name, double refresh)
 {
-    int		m;
-    XRRModeInfo	*best = NULL;
-    double	bestDist = 0;
+    int		    m;
+    XRRModeInfo	    *best = NULL;
+    double	    bestDist = 0;
+    index_entry_t   *e;
 
-    for (m = 0; m < res->nmode; m++)
+    if ((name->kind & name_xid) && (e = index_lookup_xid (&mode_xids, name->xid)))
+        return e->value;
+    if (!(name->kind & name_string) || !(e = index_lookup (&mode_names, name->string)))
+        return NULL;
+    for (m = (XRRModeInfo *) e->value - res->modes; m >= 0; m = mode_next[m])
     {
         XRRModeInfo *mode = &res->modes[m];
-        if ((name->kind & name_xid) && name->xid == mode->id)
+        double	    dist;
+
+        if (refresh)
+            dist = fabs (mode_refresh (mode) - refresh);
+        else
+            dist = 0;
+        if (!best || dist < bestDist)
         {
+            bestDist = dist;
             best = mode;
-            break;
-        }
-        if ((name->kind & name_string) && !strcmp (name->string, mode->name))
-        {
-            double   dist;
-
-            if (refresh)
-                dist = fabs (mode_refresh (mode) - refresh);
-            else
-                dist = 0;
-            if (!best || dist < bestDist)
-            {
-                bestDist = dist;
-                best = mode;
-            }
         }
     }
     return best;
@@ -1069,29 +1261,15 @@ output_can_use_rotation (output_t *output, Rotation rotation)
 static Bool
 output_is_primary(output_t *output)
 {
-    if (has_1_3)
-        return XRRGetOutputPrimary(dpy, root) == output->output.xid;
-    return False;
-}
-
-/* Returns the index of the last value in an array < 0xffff */
-static int
-find_last_non_clamped(CARD16 array[], int size) {
-    int i;
-    for (i = size - 1; i > 0; i--) {
-        if (array[i] < 0xffff)
-            return i;
-    }
-    return 0;
+    return primary_xid != None && primary_xid == output->output.xid;
 }
 
 static void
 set_gamma_info(output_t *output)
 {
     XRRCrtcGamma *crtc_gamma;
-    double i1, v1, i2, v2;
-    int size, middle, last_best, last_red, last_green, last_blue;
-    CARD16 *best_array;
+    double exponent[3], brightness;
+    int size;
 
     if (!output->crtc_info)
         return;
@@ -1109,57 +1287,16 @@ set_gamma_info(output_t *output)
     }
 
     /*
-     * Here is a bit tricky because gamma is a whole curve for each
-     * color.  So, typically, we need to represent 3 * 256 values as 3 + 1
-     * values.  Therefore, we approximate the gamma curve (v) by supposing
-     * it always follows the way we set it: a power function (i^g)
-     * multiplied by a brightness (b).
-     * v = i^g * b
-     * so g = (ln(v) - ln(b))/ln(i)
-     * and b can be found using two points (v1,i1) and (v2, i2):
-     * b = e^((ln(v2)*ln(i1) - ln(v1)*ln(i2))/ln(i1/i2))
-     * For the best resolution, we select i2 at the highest place not
-     * clamped and i1 at i2/2. Note that if i2 = 1 (as in most normal
-     * cases), then b = v2.
+     * Gamma is a whole curve for each color, it is approximated by
+     * supposing it always follows the way we set it: a power function
+     * multiplied by a brightness, see gamma_fit().
      */
-    last_red = find_last_non_clamped(crtc_gamma->red, size);
-    last_green = find_last_non_clamped(crtc_gamma->green, size);
-    last_blue = find_last_non_clamped(crtc_gamma->blue, size);
-    best_array = crtc_gamma->red;
-    last_best = last_red;
-    if (last_green > last_best) {
-        last_best = last_green;
-        best_array = crtc_gamma->green;
-    }
-    if (last_blue > last_best) {
-        last_best = last_blue;
-        best_array = crtc_gamma->blue;
-    }
-    if (last_best == 0)
-        last_best = 1;
-
-    middle = last_best / 2;
-    i1 = (double)(middle + 1) / size;
-    v1 = (double)(best_array[middle]) / 65535;
-    i2 = (double)(last_best + 1) / size;
-    v2 = (double)(best_array[last_best]) / 65535;
-    if (v2 < 0.0001) { /* The screen is black */
-        output->brightness = 0;
-        output->gamma.red = 1;
-        output->gamma.green = 1;
-        output->gamma.blue = 1;
-    } else {
-        if ((last_best + 1) == size)
-            output->brightness = v2;
-        else
-            output->brightness = exp((log(v2)*log(i1) - log(v1)*log(i2))/log(i1/i2));
-        output->gamma.red = log((double)(crtc_gamma->red[last_red / 2]) / output->brightness
-                                / 65535) / log((double)((last_red / 2) + 1) / size);
-        output->gamma.green = log((double)(crtc_gamma->green[last_green / 2]) / output->brightness
-                                  / 65535) / log((double)((last_green / 2) + 1) / size);
-        output->gamma.blue = log((double)(crtc_gamma->blue[last_blue / 2]) / output->brightness
-                                 / 65535) / log((double)((last_blue / 2) + 1) / size);
-    }
+    gamma_fit(crtc_gamma->red, crtc_gamma->green, crtc_gamma->blue, size,
+              exponent, &brightness);
+    output->brightness = brightness;
+    output->gamma.red = exponent[0];
+    output->gamma.green = exponent[1];
+    output->gamma.blue = exponent[2];
 
     XRRFreeGamma(crtc_gamma);
 }
@@ -1282,10 +1419,6 @@ set_output_info (output_t *output, RROutput xid, XRROutputInfo *output_info)
                rotation_name (output->rotation),
                reflection_name (output->rotation));
 
-    /* set gamma */
-    if (!(output->changes & changes_gamma))
-        set_gamma_info(output);
-
     /* set transformation */
     if (!(output->changes & changes_transform))
     {
@@ -1345,6 +1478,7 @@ get_screen (Bool current)
     else
         res = XRRGetScreenResources (dpy, root);
     if (!res) fatal ("could not get screen resources");
+    build_mode_index ();
 }
 
 static void
@@ -1385,7 +1519,8 @@ get_crtcs (void)
             crtcs[c].y = 0;
             crtcs[c].rotation = RR_Rotate_0;
         }
-        if (XRRGetCrtcTransform (dpy, res->crtcs[c], &attr) && attr) {
+        /* a plain query never prints the transform */
+        if (!lean_query && XRRGetCrtcTransform (dpy, res->crtcs[c], &attr) && attr) {
             set_transform (&crtcs[c].current_transform,
                            &attr->currentTransform,
                            attr->currentFilter,
@@ -1399,6 +1534,7 @@ get_crtcs (void)
         }
         copy_transform (&crtcs[c].pending_transform, &crtcs[c].current_transform);
     }
+    build_crtc_index ();
 }
 
 static void
@@ -1455,12 +1591,9 @@ set_gamma(void)
     output_t	*output;
 
     for (output = all_outputs; output; output = output->next) {
-        int i, size;
+        int size;
         crtc_t *crtc;
         XRRCrtcGamma *crtc_gamma;
-        float gammaRed;
-        float gammaGreen;
-        float gammaBlue;
 
         if (!(output->changes & changes_gamma))
             continue;
@@ -1503,32 +1636,9 @@ set_gamma(void)
         if (output->gamma.blue == 0.0)
             output->gamma.blue = 1.0;
 
-        gammaRed = 1.0 / output->gamma.red;
-        gammaGreen = 1.0 / output->gamma.green;
-        gammaBlue = 1.0 / output->gamma.blue;
-
-        for (i = 0; i < size; i++) {
-            if (gammaRed == 1.0 && output->brightness == 1.0)
-                crtc_gamma->red[i] = (double)i / (double)(size - 1) * 65535.0;
-            else
-                crtc_gamma->red[i] = dmin(pow((double)i/(double)(size - 1),
-                                              gammaRed) * output->brightness,
-                                          1.0) * 65535.0;
-
-            if (gammaGreen == 1.0 && output->brightness == 1.0)
-                crtc_gamma->green[i] = (double)i / (double)(size - 1) * 65535.0;
-            else
-                crtc_gamma->green[i] = dmin(pow((double)i/(double)(size - 1),
-                                                gammaGreen) * output->brightness,
-                                            1.0) * 65535.0;
-
-            if (gammaBlue == 1.0 && output->brightness == 1.0)
-                crtc_gamma->blue[i] = (double)i / (double)(size - 1) * 65535.0;
-            else
-                crtc_gamma->blue[i] = dmin(pow((double)i/(double)(size - 1),
-                                               gammaBlue) * output->brightness,
-                                           1.0) * 65535.0;
-        }
+        gamma_ramp(crtc_gamma->red, crtc_gamma->green, crtc_gamma->blue, size,
+                   output->gamma.red, output->gamma.green, output->gamma.blue,
+                   output->brightness);
 
         XRRSetCrtcGamma(dpy, crtc->crtc.xid, crtc_gamma);
 
@@ -1816,6 +1926,10 @@ get_outputs (void)
     int		o;
     output_t    *q;
 
+    /* one request for all outputs instead of one per output */
+    if (has_1_3)
+        primary_xid = XRRGetOutputPrimary (dpy, root);
+
     for (o = 0; o < res->noutput; o++)
     {
         XRROutputInfo	*output_info = XRRGetOutputInfo (dpy, res, res->outputs[o]);
@@ -1892,6 +2006,7 @@ get_outputs (void)
                     q->output.string);
         }
     }
+    build_output_index ();
 }
 
 static void
@@ -2008,79 +2123,117 @@ find_crtc_for_output (output_t *output)
     return NULL;
 }
 
-static void
-set_positions (void)
+/* Index entry of the output itself, NULL if it has no name or shares it */
+static index_entry_t *
+output_entry (output_t *output)
 {
-    output_t	*output;
-    Bool	keep_going;
-    Bool	any_set;
-    int		min_x, min_y;
+    index_entry_t *e;
+
+    if (!(output->output.kind & name_string))
+        return NULL;
+    e = index_lookup (&output_names, output->output.string);
+    return e && e->value == output ? e : NULL;
+}
 
-    for (;;)
+static void
+place_relative (output_t *output, output_t *relation)
+{
+    if (relation->mode_info == NULL)
     {
-        any_set = False;
-        keep_going = False;
-        for (output = all_outputs; output; output = output->next)
-        {
-            output_t    *relation;
-            name_t	relation_name;
+        output->x = 0;
+        output->y = 0;
+        output->changes |= changes_position;
+        return;
+    }
+    switch (output->relation) {
+        case relation_left_of:
+            output->y = relation->y;
+            output->x = relation->x - mode_width (output->mode_info, output->rotation);
+            break;
+        case relation_right_of:
+            output->y = relation->y;
+            output->x = relation->x + mode_width (relation->mode_info, relation->rotation);
+            break;
+        case relation_above:
+            output->x = relation->x;
+            output->y = relation->y - mode_height (output->mode_info, output->rotation);
+            break;
+        case relation_below:
+            output->x = relation->x;
+            output->y = relation->y + mode_height (relation->mode_info, relation->rotation);
+            break;
+        case relation_same_as:
+            output->x = relation->x;
+            output->y = relation->y;
+    }
+    output->changes |= changes_position;
+}
 
-            if (!(output->changes & changes_relation)) continue;
+/* Whether outputs placed relative to this one have to wait for it */
+static Bool
+position_pending (output_t *output)
+{
+    return output->mode_info != NULL &&
+        (output->changes & changes_relation) && !(output->changes & changes_position);
+}
 
-            if (output->mode_info == NULL) continue;
+/*
+ * Every output is relative to at most one other, so the relations form
+ * chains. Each chain is followed up to an output whose position is known
+ * and placed from there back down, which visits every output once. An
+ * output met again on the chain being followed closes a loop.
+ */
+static void
+set_positions (void)
+{
+    output_t	    *output, *o, **chain, **relations;
+    index_entry_t   *e, *self;
+    int		    n = 0, depth, i;
+    int		    min_x, min_y;
 
-            init_name (&relation_name);
-            set_name_string (&relation_name, output->relative_to);
-            relation = find_output (&relation_name);
-            if (!relation) fatal ("cannot find output \"%s\"\n", output->relative_to);
+    if (!outputs_indexed)
+        build_output_index ();
+    for (output = all_outputs; output; output = output->next)
+        n++;
+    chain = calloc (n + 1, sizeof (output_t *));
+    relations = calloc (n + 1, sizeof (output_t *));
+    if (!chain || !relations)
+        fatal ("out of memory\n");
 
-            if (relation->mode_info == NULL)
-            {
-                output->x = 0;
-                output->y = 0;
-                output->changes |= changes_position;
-                any_set = True;
-                continue;
-            }
-            /*
-             * Make sure the dependent object has been set in place
-             */
-            if ((relation->changes & changes_relation) &&
-                !(relation->changes & changes_position))
-            {
-                keep_going = True;
-                continue;
-            }
+    for (output = all_outputs; output; output = output->next)
+    {
+        if (!position_pending (output)) continue;
 
-            switch (output->relation) {
-                case relation_left_of:
-                    output->y = relation->y;
-                    output->x = relation->x - mode_width (output->mode_info, output->rotation);
-                    break;
-                case relation_right_of:
-                    output->y = relation->y;
-                    output->x = relation->x + mode_width (relation->mode_info, relation->rotation);
-                    break;
-                case relation_above:
-                    output->x = relation->x;
-                    output->y = relation->y - mode_height (output->mode_info, output->rotation);
-                    break;
-                case relation_below:
-                    output->x = relation->x;
-                    output->y = relation->y + mode_height (relation->mode_info, relation->rotation);
-                    break;
-                case relation_same_as:
-                    output->x = relation->x;
-                    output->y = relation->y;
+        depth = 0;
+        for (o = output;; o = relations[depth - 1])
+        {
+            if (!(e = index_lookup (&output_names, o->relative_to)))
+                fatal ("cannot find output \"%s\"\n", o->relative_to);
+            chain[depth] = o;
+            relations[depth++] = e->value;
+            /* outputs without a name of their own can not be part of a loop */
+            if ((self = output_entry (o)))
+                self->mark = depth;
+            if (!position_pending (e->value))
+                break;
+            if (e->mark)
+            {
+                fprintf (stderr, "%s: loop in relative position specifications:", program_name);
+                for (i = e->mark - 1; i < depth; i++)
+                    fprintf (stderr, " %s ->", chain[i]->output.string);
+                fprintf (stderr, " %s\n", relations[depth - 1]->output.string);
+                exit (1);
             }
-            output->changes |= changes_position;
-            any_set = True;
         }
-        if (!keep_going)
-            break;
-        if (!any_set)
-            fatal ("loop in relative position specifications\n");
+        while (depth--)
+        {
+            place_relative (chain[depth], relations[depth]);
+            if ((self = output_entry (chain[depth])))
+                self->mark = 0;
+        }
     }
+    free (chain);
+    free (relations);
 
     /*
      * Now normalize positions so the upper left corner of all outputs is at 0,0
@@ -3685,6 +3838,7 @@ main (int argc, char **argv)
 
 #define ModeShown   0x80000000
 
+        lean_query = !verbose;
         get_screen (current);
         get_crtcs ();
         get_outputs ();
@@ -3790,6 +3944,8 @@ main (int argc, char **argv)
                 printf ("\tIdentifier: 0x%x\n", (int)output->output.xid);
                 printf ("\tTimestamp:  %d\n", (int)output_info->timestamp);
                 printf ("\tSubpixel:   %s\n", order[output_info->subpixel_order]);
+                /* the current gamma is only ever printed, fetch it here */
+                set_gamma_info (output);
                 if (output->gamma.red != 0.0 && output->gamma.green != 0.0 && output->gamma.blue != 0.0) {
                     printf ("\tGamma:      %#.2g:%#.2g:%#.2g\n",
                             output->gamma.red, output->gamma.green, output->gamma.blue);